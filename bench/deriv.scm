@@ -0,0 +1,32 @@
+; Symbolic differentiation of a polynomial, after the Gabriel deriv
+; benchmark: many small conses and symbol comparisons.
+; Run with: c_scheme bench/deriv.scm
+(define (list . items) items)
+(define (map f l)
+  (if (null? l) '() (cons (f (car l)) (map f (cdr l)))))
+(define (deriv a)
+  (if (pair? a)
+      (if (eq? (car a) '+)
+          (cons '+ (map deriv (cdr a)))
+          (if (eq? (car a) '-)
+              (cons '- (map deriv (cdr a)))
+              (if (eq? (car a) '*)
+                  (list '*
+                        a
+                        (cons '+ (map (lambda (a) (list '/ (deriv a) a)) (cdr a))))
+                  (if (eq? (car a) '/)
+                      (list '-
+                            (list '/ (deriv (car (cdr a))) (car (cdr (cdr a))))
+                            (list '/
+                                  (car (cdr a))
+                                  (list '*
+                                        (car (cdr (cdr a)))
+                                        (car (cdr (cdr a)))
+                                        (deriv (car (cdr (cdr a)))))))
+                      (display "deriv: unknown operator")))))
+      (if (eq? a 'x) 1 0)))
+(define expr '(+ (* 3 x x) (* a x x) (* b x) 5))
+(define (repeat n result)
+  (if (= n 0) result (repeat (- n 1) (deriv expr))))
+(display (repeat 20000 0))
+(newline)
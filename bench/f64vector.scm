@@ -0,0 +1,19 @@
+; Bulk flonum vectors: fill a 1e6 element f64vector, then take its sum and
+; its dot product with itself 100 times each.
+; Run with: c_scheme bench/f64vector.scm
+(define n 1000000)
+(define x (make-f64vector n 0.0))
+(define (fill i)
+  (if (< i n)
+      (fill-next i)
+      x))
+(define (fill-next i)
+  (f64vector-set! x i (/ 1.0 (+ i 1)))
+  (fill (+ i 1)))
+(fill 0)
+(define (repeat k acc)
+  (if (= k 0)
+      acc
+      (repeat (- k 1) (+ (f64vector-sum x) (f64vector-dot x x)))))
+(display (repeat 100 0.0))
+(newline)
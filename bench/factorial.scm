@@ -0,0 +1,11 @@
+; Bignum multiplication: 1000! two hundred times, then 1000! squared,
+; which is large enough for Karatsuba.
+; Run with: c_scheme bench/factorial.scm
+(define (fact n) (if (= n 0) 1 (* n (fact (- n 1)))))
+(define (repeat n result)
+  (if (= n 0)
+      result
+      (repeat (- n 1) (fact 1000))))
+(define f (repeat 200 0))
+(display (* f f))
+(newline)
@@ -0,0 +1,8 @@
+; Procedure calls and fixnum arithmetic: doubly recursive fibonacci.
+; Run with: c_scheme bench/fib.scm
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+(display (fib 30))
+(newline)
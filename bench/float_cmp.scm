@@ -0,0 +1,23 @@
+; Comparisons of the special flonums: every ordered pair of 0.0, -0.0, 1.0,
+; the infinities and a NaN under <, = and eqv?, 20000 times over, after
+; printing the specials that arithmetic produces.
+; Run with: c_scheme bench/float_cmp.scm
+(define specials (vector 0.0 -0.0 1.0 +inf.0 -inf.0 +nan.0))
+(display (vector (/ 1.0 0.0) (- 0.0 (/ 1.0 0.0)) (- (/ 1.0 0.0) (/ 1.0 0.0)) (* -1.0 0.0)))
+(newline)
+(define (compare-all rounds i j lt eq same)
+  (if (= rounds 0)
+      (vector lt eq same)
+      (if (= i 6)
+          (compare-all (- rounds 1) 0 0 lt eq same)
+          (if (= j 6)
+              (compare-all rounds (+ i 1) 0 lt eq same)
+              (compare-pair rounds i j lt eq same
+                            (vector-ref specials i) (vector-ref specials j))))))
+(define (compare-pair rounds i j lt eq same a b)
+  (compare-all rounds i (+ j 1)
+               (if (< a b) (+ lt 1) lt)
+               (if (= a b) (+ eq 1) eq)
+               (if (eqv? a b) (+ same 1) same)))
+(display (compare-all 20000 0 0 0 0 0))
+(newline)
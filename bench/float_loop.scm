@@ -0,0 +1,16 @@
+; Flonum arithmetic: sum of 1/k^2 for k up to 1e6, which approaches pi^2/6,
+; and a leapfrog integration of a unit spring over 1e6 steps.
+; Run with: c_scheme bench/float_loop.scm
+(define (basel k n acc)
+  (if (> k n)
+      acc
+      (basel (+ k 1) n (+ acc (/ 1.0 (* k k))))))
+(display (basel 1 1000000 0.0))
+(newline)
+(define dt 0.001)
+(define (spring steps x v)
+  (if (= steps 0)
+      x
+      (spring (- steps 1) (+ x (* dt v)) (- v (* dt (+ x (* dt v)))))))
+(display (spring 1000000 1.0 0.0))
+(newline)
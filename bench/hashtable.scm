@@ -0,0 +1,19 @@
+; Aggregation by key: count 200000 pseudo-random fixnums into 1000 buckets
+; of a hash table, then sum the counts back out.
+; Run with: c_scheme bench/hashtable.scm
+(define counts (make-hash-table))
+(define (add1 n) (+ n 1))
+(define (bucket x)
+  (if (< x 1000) x (bucket (- x 1000))))
+(define (count-step i x)
+  (hash-table-update! counts (bucket x) add1 0)
+  (count (- i 1) (if (< (+ x 7919) 10007) (+ x 7919) (- (+ x 7919) 10007))))
+(define (count i x)
+  (if (= i 0) 0 (count-step i x)))
+(count 200000 1)
+(define (sum l acc)
+  (if (null? l) acc (sum (cdr l) (+ acc (car l)))))
+(display (hash-table-count counts))
+(newline)
+(display (sum (hash-table-values counts) 0))
+(newline)
@@ -0,0 +1,28 @@
+; List allocation and backtracking: count the solutions to eight queens.
+; Run with: c_scheme bench/nqueens.scm
+(define (iota n)
+  (define (loop i acc)
+    (if (= i 0) acc (loop (- i 1) (cons i acc))))
+  (loop n '()))
+(define (append a b)
+  (if (null? a) b (cons (car a) (append (cdr a) b))))
+(define (ok? row dist placed)
+  (if (null? placed)
+      #t
+      (if (= (car placed) (+ row dist))
+          #f
+          (if (= (car placed) (- row dist))
+              #f
+              (ok? row (+ dist 1) (cdr placed))))))
+(define (try-it x y z)
+  (if (null? x)
+      (if (null? y) 1 0)
+      (+ (if (ok? (car x) 1 z)
+             (try-it (append (cdr x) y) '() (cons (car x) z))
+             0)
+         (try-it (cdr x) (cons (car x) y) z))))
+(define (queens n) (try-it (iota n) '() '()))
+(define (repeat n result)
+  (if (= n 0) result (repeat (- n 1) (queens 8))))
+(display (repeat 10 0))
+(newline)
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Runs every benchmark in bench/ under each execution mode and tabulates the
+# figures reported by --stats. Given the runtime library as well, also
+# compiles each benchmark with --compile and runs the result. What each run
+# prints is compared with the expected output in bench/<name>.out, so every
+# mode has to agree. Exits non-zero if any run fails or prints anything else.
+# Usage: sh bench/run.sh [interpreter [libc_scheme.a]]
+interp=${1:-./c_scheme}
+lib=$2
+dir=$(dirname "$0")
+CC=${CC:-cc}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+status=0
+printf '%-12s %-10s %10s %12s %12s %12s\n' \
+    benchmark mode "time ms" "eval steps" applications allocations
+for b in "$dir"/*.scm; do
+    name=$(basename "$b" .scm)
+    for mode in eval vm analyze compiled; do
+        case $mode in
+            eval) run="$interp" ;;
+            compiled)
+                [ -n "$lib" ] || continue
+                if ! err=$($interp --compile "$b" -o "$tmp/$name.c" 2>&1 &&
+                        $CC -O2 -I"$(dirname "$lib")" -o "$tmp/$name" "$tmp/$name.c" "$lib" -lm 2>&1); then
+                    echo "$name ($mode) failed to build:" >&2
+                    echo "$err" >&2
+                    status=1
+                    continue
+                fi
+                run="$tmp/$name" ;;
+            *) run="$interp --$mode" ;;
+        esac
+        if [ $mode = compiled ]; then
+            set -- --stats
+        else
+            set -- --stats "$b"
+        fi
+        if ! err=$($run "$@" 2>&1 >"$tmp/$name.$mode.out"); then
+            echo "$name ($mode) failed:" >&2
+            echo "$err" >&2
+            status=1
+            continue
+        fi
+        if ! diff -u "$dir/$name.out" "$tmp/$name.$mode.out" >&2; then
+            echo "$name ($mode) printed unexpected output" >&2
+            status=1
+        fi
+        echo "$err" | awk -v name="$name" -v mode="$mode" '
+            /^ERROR/ { failed = 1 }
+            /^Stats:/ {
+                gsub(",", "")
+                printf "%-12s %-10s %10s %12s %12s %12s\n", name, mode, $2, $4, $7, $9
+            }
+            END { exit failed }' || { echo "$name ($mode) reported errors" >&2; status=1; }
+    done
+done
+exit $status
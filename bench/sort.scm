@@ -0,0 +1,38 @@
+; Merge sort of 20000 pseudo-random fixnums: list splitting and merging.
+; Run with: c_scheme bench/sort.scm
+(define (numbers i x acc)
+  (if (= i 0)
+      acc
+      (numbers (- i 1)
+               (if (< (+ x 7919) 10007) (+ x 7919) (- (+ x 7919) 10007))
+               (cons x acc))))
+(define (merge a b)
+  (if (null? a)
+      b
+      (if (null? b)
+          a
+          (if (< (car b) (car a))
+              (cons (car b) (merge a (cdr b)))
+              (cons (car a) (merge (cdr a) b))))))
+(define (split l a b)
+  (if (null? l)
+      (cons a b)
+      (split (cdr l) (cons (car l) b) a)))
+(define (sort l)
+  (if (null? l)
+      l
+      (if (null? (cdr l))
+          l
+          (merge (sort (car (split l '() '())))
+                 (sort (cdr (split l '() '())))))))
+(define (sorted? l)
+  (if (null? l)
+      #t
+      (if (null? (cdr l))
+          #t
+          (if (< (car (cdr l)) (car l)) #f (sorted? (cdr l))))))
+(define s (sort (numbers 20000 1 '())))
+(display (sorted? s))
+(newline)
+(display (car s))
+(newline)
@@ -0,0 +1,33 @@
+; String building: write the integers below 20000 to a string port joined
+; with commas, split the text back into fields with substring, and join
+; them again through another port.
+; Run with: c_scheme bench/string.scm
+(define (build port i n)
+  (if (= i n)
+      (get-output-string port)
+      (build-step port i n)))
+(define (build-step port i n)
+  (display i port)
+  (write-char #\, port)
+  (build port (+ i 1) n))
+(define (split s i start fields)
+  (if (= i (string-length s))
+      fields
+      (if (eq? (string-ref s i) #\,)
+          (split s (+ i 1) (+ i 1) (cons (substring s start i) fields))
+          (split s (+ i 1) start fields))))
+(define (join port fields)
+  (if (null? fields)
+      (get-output-string port)
+      (join-step port fields)))
+(define (join-step port fields)
+  (write-string (string-append (car fields) ";") port)
+  (join port (cdr fields)))
+(define (run n result)
+  (if (= n 0)
+      result
+      (run (- n 1)
+           (string-length (join (open-output-string)
+                                (split (build (open-output-string) 0 20000) 0 0 '()))))))
+(display (run 5 0))
+(newline)
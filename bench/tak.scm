@@ -0,0 +1,10 @@
+; Deep non-tail recursion with three arguments: the Takeuchi function.
+; Run with: c_scheme bench/tak.scm
+(define (tak x y z)
+  (if (< y x)
+      (tak (tak (- x 1) y z)
+           (tak (- y 1) z x)
+           (tak (- z 1) x y))
+      z))
+(display (tak 24 16 8))
+(newline)
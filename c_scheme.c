@@ -1,64 +1,80 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
+#include <stddef.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "c_scheme.h"
 
-#define MAX_TOK_LEN 32
-#define MAX_LINE_LEN 1024
+#define SYMBOL_TABLE_INITIAL_SIZE 256
+#define GLOBAL_TABLE_INITIAL_SIZE 256
+#define HASH_TABLE_INITIAL_SIZE 8
+#define SHARED_SUBSTRING_MIN 32
+#define DEFAULT_HEAP_SIZE (1 << 20)
+#define SLAB_OBJECTS 4096
+#define MAX_SLAB_CELLS 8
+
+// Compile with -DMALLOC_OBJECTS to allocate every Object with its own malloc
+// instead of carving them out of slabs, e.g. to compare throughput and RSS.
 
 // ..................................Types....................................
-typedef enum Boolean {FALSE, TRUE} Boolean;
-
-typedef enum ObjectType {INT, CHAR, FUNCTION, STRING, SYMBOL, PAIR, NILL} ObjectType;
-
-typedef struct Object {
-    ObjectType type;
-    union {
-        long integer;
-        char character;
-        char *string;
-        char *symbol;
-        struct pair {
-            struct Object *car;
-            struct Object *cdr;
-        } pair;
-        struct Object* (*function)(struct Object*);
-    } value;
-} Object;
-
-Object *nill;
-Object *primitive_procedure_tag;
-Object *compound_procedure_tag;
-
-// keywords
-Object lambda_sym = { .type=SYMBOL, .value.symbol="lambda"};
-Object if_sym = { .type=SYMBOL, .value.symbol="if"};
-Object define_sym = { .type=SYMBOL, .value.symbol="define"};
-Object quote_sym = { .type=SYMBOL, .value.symbol="quote"};
-
-// true / false
-Object true_sym = { .type=SYMBOL, .value.symbol="#t"};
-Object false_sym = { .type=SYMBOL, .value.symbol="#f"};
+// Object, its immediates and what compiled code needs inline are in
+// c_scheme.h.
+
+// The script path and its arguments as strings, set by main in batch mode.
+Object *command_line_arguments;
+
+// keywords, interned in init
+Object *lambda_sym;
+Object *if_sym;
+Object *define_sym;
+Object *quote_sym;
+Object *set_sym;
+Object *profile_sym;
+
 
+// Most errors are reported and the failing operation returns () to carry on.
+// error_count lets batch mode stop at the first expression that failed.
+FILE *error_output;
+size_t error_count;
+
+void flush_stdout_port(void);
+
+void report_error(const char *format, ...)
+{
+    flush_stdout_port();
+    va_list args;
+    va_start(args, format);
+    fprintf(error_output, "ERROR: ");
+    vfprintf(error_output, format, args);
+    fprintf(error_output, "\n");
+    va_end(args);
+    ++error_count;
+}
 
 Object *car(Object *obj) 
 {
-    if (obj->type == PAIR) {
+    if (has_type(obj, PAIR)) {
         return obj->value.pair.car;
     }
     else {
-        printf("Error: Called car on non-pair. Exiting.\n");
+        report_error("Called car on non-pair. Exiting.");
         exit(EXIT_FAILURE);
     }
 }
 
 Object *cdr(Object *obj)
 {
-    if (obj->type == PAIR) {
+    if (has_type(obj, PAIR)) {
         return obj->value.pair.cdr;
     }
     else {
-        printf("Error: Called cdr on non-pair. Exiting.\n");
+        report_error("Called cdr on non-pair. Exiting.");
         exit(EXIT_FAILURE);
     }
 }
@@ -93,6 +109,11 @@ Object *cddr(Object *pair)
     return cdr(cdr(pair));
 }
 
+Object *cdddr(Object *pair)
+{
+    return cdr(cddr(pair));
+}
+
 void set_car(Object *obj, Object *val)
 {
     obj->value.pair.car = val;
@@ -103,53 +124,422 @@ void set_cdr(Object *obj, Object *val)
     obj->value.pair.cdr = val;
 }
 
-Object *alloc_object(ObjectType type)
+// ...............................Allocation..................................
+// Objects are carved out of contiguous slabs of SLAB_OBJECTS cells, each
+// cell the size of one Object. Most objects take one cell; variable-sized
+// ones such as frames take a run of up to MAX_SLAB_CELLS adjacent cells.
+// Allocation bumps a pointer through the current free run. The collector
+// coalesces dead cells into runs kept on free_lists by length (FREE objects
+// chained through their cdr; the last list holds every run of
+// MAX_SLAB_CELLS or more), and a fresh slab is only taken when no run fits.
+// Anything bigger, or everything when compiled with MALLOC_OBJECTS, is
+// malloced on its own and threaded onto large_objects for the sweep.
+// Any Object* held in a C local across a call that may allocate must be
+// registered with PROTECT and released with UNPROTECT, otherwise a collection
+// can free it underneath us.
+typedef struct LargeObject {
+    struct LargeObject *next;
+    size_t cells;
+    Object object[];
+} LargeObject;
+
+LargeObject *large_objects;
+
+#ifndef MALLOC_OBJECTS
+typedef struct Slab {
+    struct Slab *next;
+    Object objects[SLAB_OBJECTS];
+} Slab;
+
+Slab *slabs;
+Object *free_lists[MAX_SLAB_CELLS + 1];
+Object *bump_next;
+Object *bump_limit;
+#endif
+size_t gc_live_cells;
+size_t gc_heap_size = DEFAULT_HEAP_SIZE;
+size_t gc_allocated_objects; // ever, for the profiler
+
+Object ***gc_roots;
+size_t gc_root_count;
+size_t gc_root_capacity;
+
+void gc_collect(void);
+
+// Running out of memory ends the run, since nothing can unwind from the
+// middle of the interpreter, except where a primitive asked for a large
+// object and can report it, see try_alloc_cells.
+void out_of_memory(void)
+{
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+}
+
+#ifndef MALLOC_OBJECTS
+void release_cells(Object *obj, size_t cells)
+{
+    size_t bucket = cells < MAX_SLAB_CELLS ? cells : MAX_SLAB_CELLS;
+    obj->type = FREE;
+    obj->cells = cells;
+    obj->value.pair.cdr = free_lists[bucket];
+    free_lists[bucket] = obj;
+}
+
+// Hands what is left of the bump run back to the free lists, so every cell
+// of every slab is covered by an object or FREE header when the sweep walks.
+void retire_bump_run(void)
+{
+    if (bump_next < bump_limit)
+        release_cells(bump_next, bump_limit - bump_next);
+    bump_next = bump_limit = NULL;
+}
+
+void refill_bump_run(size_t cells)
+{
+    retire_bump_run();
+    for (size_t n = MAX_SLAB_CELLS; n >= cells; n--) {
+        Object *run = free_lists[n];
+        if (run) {
+            free_lists[n] = run->value.pair.cdr;
+            bump_next = run;
+            bump_limit = run + run->cells;
+            return;
+        }
+    }
+    Slab *slab = (Slab*)malloc(sizeof(Slab));
+    if (!slab)
+        out_of_memory();
+    slab->next = slabs;
+    slabs = slab;
+    bump_next = slab->objects;
+    bump_limit = slab->objects + SLAB_OBJECTS;
+}
+
+Object *alloc_slab_cells(size_t cells)
+{
+    if (bump_next + cells > bump_limit)
+        refill_bump_run(cells);
+    Object *obj = bump_next;
+    bump_next += cells;
+    return obj;
+}
+#endif
+
+// Only a large object can fail to be allocated, giving NULL. Primitives
+// whose arguments choose the size call this and report the failure.
+Object *try_alloc_cells(ObjectType type, size_t cells)
 {
-    Object *new_obj = (Object*)malloc(sizeof(Object));
+    if (gc_live_cells + cells > gc_heap_size)
+        gc_collect();
+    Object *new_obj;
+#ifndef MALLOC_OBJECTS
+    if (cells <= MAX_SLAB_CELLS) {
+        new_obj = alloc_slab_cells(cells);
+        new_obj->cells = cells;
+    }
+    else
+#endif
+    {
+        LargeObject *large = malloc(sizeof(LargeObject) + cells * sizeof(Object));
+        if (!large)
+            return NULL;
+        large->next = large_objects;
+        large->cells = cells;
+        large_objects = large;
+        new_obj = large->object;
+        new_obj->cells = 0;
+    }
     new_obj->type = type;
+    new_obj->marked = 0;
+    gc_live_cells += cells;
+    gc_allocated_objects++;
+    return new_obj;
+}
+
+Object *alloc_cells(ObjectType type, size_t cells)
+{
+    Object *new_obj = try_alloc_cells(type, cells);
+    if (!new_obj)
+        out_of_memory();
+    return new_obj;
+}
+
+Object *alloc_object(ObjectType type)
+{
+    return alloc_cells(type, 1);
+}
+
+Object *new_primitive(const struct Primitive *primitive)
+{
+    Object *new_obj = alloc_object(PRIMITIVE);
+    new_obj->value.primitive = primitive;
+    return new_obj;
+}
+
+Object *new_closure(Object *lambda, Object *env)
+{
+    PROTECT(lambda);
+    PROTECT(env);
+    Object *new_obj = alloc_object(CLOSURE);
+    UNPROTECT(2);
+    new_obj->value.closure.lambda = lambda;
+    new_obj->value.closure.env = env;
     return new_obj;
 }
 
-Object *new_int(long i)
+Object *new_native(const NativeLambda *lambda)
 {
-    Object *new_obj = alloc_object(INT);
-    new_obj->value.integer = i;
+    Object *name = lambda->name ? intern(lambda->name) : nill;
+    Object *new_obj = alloc_object(NATIVE);
+    new_obj->value.native.lambda = lambda;
+    new_obj->value.native.name = name;
     return new_obj;
 }
 
-Object *new_char(char c)
+// Strings are immutable and carry their length, so they may contain '\0'
+// and are never terminated by one. The bytes are left for the caller to fill
+// in. Gives NULL if there is no memory for them.
+Object *alloc_string(size_t length)
 {
-    Object *new_obj = alloc_object(CHAR);
-    new_obj->value.character = c;
+    Object *new_obj = try_alloc_cells(STRING, 1 + (length + sizeof(Object) - 1) / sizeof(Object));
+    if (!new_obj)
+        return NULL;
+    new_obj->value.string.chars = (char*)(new_obj + 1);
+    new_obj->value.string.length = length;
+    new_obj->value.string.hash = 0;
     return new_obj;
 }
 
-Object *new_function(Object* (*fun)(Object*))
+Object *new_string(const char *chars, size_t length)
 {
-    Object *new_obj = alloc_object(FUNCTION);
-    new_obj->value.function = fun;
+    Object *new_obj = alloc_string(length);
+    if (!new_obj)
+        out_of_memory();
+    memcpy(new_obj->value.string.chars, chars, length);
     return new_obj;
 }
 
-Object *new_string(char *str)
+// The string whose cells hold string's bytes. A shared substring keeps it
+// in the cell after its header.
+static inline Object *string_base(Object *string)
 {
-    Object *new_obj = alloc_object(STRING);
-    new_obj->value.string = malloc(strlen(str) + 1);
-    strcpy(new_obj->value.string, str);
+    if (string->value.string.chars == (char*)(string + 1))
+        return string;
+    return *(Object**)(string + 1);
+}
+
+// Long substrings share their source's bytes; short ones are copied, so a
+// small piece of a large string does not keep all of it alive.
+Object *new_substring(Object *string, size_t start, size_t length)
+{
+    if (length < SHARED_SUBSTRING_MIN)
+        return new_string(string->value.string.chars + start, length);
+    PROTECT(string);
+    Object *new_obj = alloc_cells(STRING, 2);
+    UNPROTECT(1);
+    new_obj->value.string.chars = string->value.string.chars + start;
+    new_obj->value.string.length = length;
+    new_obj->value.string.hash = 0;
+    *(Object**)(new_obj + 1) = string_base(string);
     return new_obj;
 }
 
+// Strings whose hashes are both known and differ are unequal without
+// looking at their bytes.
+static inline char string_equal(Object *a, Object *b)
+{
+    uint32_t length = a->value.string.length;
+    if (length != b->value.string.length)
+        return 0;
+    if (a->value.string.hash && b->value.string.hash && a->value.string.hash != b->value.string.hash)
+        return 0;
+    return memcmp(a->value.string.chars, b->value.string.chars, length) == 0;
+}
+
 Object *new_symbol(char *sym)
 {
     Object *new_obj = alloc_object(SYMBOL);
-    new_obj->value.string = malloc(strlen(sym) + 1);
-    strcpy(new_obj->value.string, sym);
+    new_obj->value.symbol = malloc(strlen(sym) + 1);
+    strcpy(new_obj->value.symbol, sym);
+    new_obj->value.text.hash = 0;
+    return new_obj;
+}
+
+// ..............................Symbol table..................................
+// Every symbol is interned, so two symbols with the same name are the same
+// Object and symbol comparison is pointer equality.
+// Open addressing with linear probing, kept at most half full.
+Object **symbol_table;
+size_t symbol_table_size;
+size_t symbol_table_count;
+
+unsigned long hash_string(char *s)
+{
+    unsigned long h = 14695981039346656037UL; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+unsigned long hash_bytes(const void *bytes, size_t n)
+{
+    const unsigned char *b = bytes;
+    unsigned long h = 14695981039346656037UL; // FNV-1a
+    while (n--) {
+        h ^= *b++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// The hash of a symbol's name, computed once. 0 means not yet
+// computed, so a text hashing to 0 is given 1 instead.
+static inline unsigned long text_hash(Object *obj)
+{
+    if (obj->value.text.hash == 0) {
+        unsigned long h = hash_string(obj->value.text.chars);
+        obj->value.text.hash = h ? h : 1;
+    }
+    return obj->value.text.hash;
+}
+
+static inline unsigned long string_hash(Object *string)
+{
+    if (string->value.string.hash == 0) {
+        uint32_t h = hash_bytes(string->value.string.chars, string->value.string.length);
+        string->value.string.hash = h ? h : 1;
+    }
+    return string->value.string.hash;
+}
+
+static inline size_t hash_pointer(Object *obj)
+{
+    return ((uintptr_t)obj >> 3) * 11400714819323198485UL;
+}
+
+void init_symbol_table(void)
+{
+    symbol_table_size = SYMBOL_TABLE_INITIAL_SIZE;
+    symbol_table_count = 0;
+    symbol_table = calloc(symbol_table_size, sizeof(Object*));
+}
+
+void grow_symbol_table(void)
+{
+    Object **old_table = symbol_table;
+    size_t old_size = symbol_table_size;
+    symbol_table_size *= 2;
+    symbol_table = calloc(symbol_table_size, sizeof(Object*));
+    for (size_t i = 0; i < old_size; i++) {
+        Object *sym = old_table[i];
+        if (sym) {
+            size_t j = text_hash(sym) & (symbol_table_size - 1);
+            while (symbol_table[j])
+                j = (j + 1) & (symbol_table_size - 1);
+            symbol_table[j] = sym;
+        }
+    }
+    free(old_table);
+}
+
+Object *intern(char *name)
+{
+    unsigned long hash = hash_string(name);
+    size_t i = hash & (symbol_table_size - 1);
+    while (symbol_table[i]) {
+        if (strcmp(symbol_table[i]->value.symbol, name) == 0)
+            return symbol_table[i];
+        i = (i + 1) & (symbol_table_size - 1);
+    }
+    Object *sym = new_symbol(name);
+    sym->value.text.hash = hash ? hash : 1;
+    symbol_table[i] = sym;
+    if (2 * ++symbol_table_count > symbol_table_size)
+        grow_symbol_table();
+    return sym;
+}
+
+// Enters a symbol made elsewhere, i.e. loaded from a heap image, whose name
+// is not in the table yet.
+void insert_symbol(Object *sym)
+{
+    size_t i = text_hash(sym) & (symbol_table_size - 1);
+    while (symbol_table[i])
+        i = (i + 1) & (symbol_table_size - 1);
+    symbol_table[i] = sym;
+    if (2 * ++symbol_table_count > symbol_table_size)
+        grow_symbol_table();
+}
+
+Object *new_local_ref(Object *name, int depth, int index)
+{
+    Object *new_obj = alloc_object(LOCAL_REF);
+    new_obj->value.ref.name = name;
+    new_obj->value.ref.depth = depth;
+    new_obj->value.ref.index = index;
+    return new_obj;
+}
+
+Object *new_global_ref(Object *name, Object *binding)
+{
+    Object *new_obj = alloc_object(GLOBAL_REF);
+    new_obj->value.global_ref.name = name;
+    new_obj->value.global_ref.binding = binding;
+    return new_obj;
+}
+
+// For (runtime-stats) and --stats: the most frames ever chained between a
+// new frame and the global environment, itself included.
+size_t environment_depth_peak;
+
+Object *new_frame(Object *names, int size, Object *parent)
+{
+    // parents follow lexical nesting, not calls, so the walk is short
+    size_t depth = 1;
+    for (Object *p = parent; has_type(p, FRAME); p = p->value.frame.parent)
+        depth++;
+    if (depth > environment_depth_peak)
+        environment_depth_peak = depth;
+    PROTECT(names);
+    PROTECT(parent);
+    size_t slot_cells = (size * sizeof(Object*) + sizeof(Object) - 1) / sizeof(Object);
+    Object *new_obj = alloc_cells(FRAME, 1 + slot_cells);
+    UNPROTECT(2);
+    new_obj->value.frame.parent = parent;
+    new_obj->value.frame.names = names;
+    Object **slots = frame_slots(new_obj);
+    for (int i = 0; i < size; i++)
+        slots[i] = unassigned;
+    return new_obj;
+}
+
+// An analyzed expression: the C function that runs it and count parts
+// (subexpression nodes, constants, refs) stored after the header.
+static inline Object **node_parts(Object *node)
+{
+    return (Object**)(node + 1);
+}
+
+Object *new_node(Object* (*execute)(Object*, Object*), int count)
+{
+    size_t part_cells = (count * sizeof(Object*) + sizeof(Object) - 1) / sizeof(Object);
+    Object *new_obj = alloc_cells(NODE, 1 + part_cells);
+    new_obj->value.node.execute = execute;
+    new_obj->value.node.count = count;
+    Object **parts = node_parts(new_obj);
+    for (int i = 0; i < count; i++)
+        parts[i] = nill;
     return new_obj;
 }
 
 Object *cons(Object *head, Object *tail) 
 {
+    PROTECT(head);
+    PROTECT(tail);
     Object *new_obj = alloc_object(PAIR);
+    UNPROTECT(2);
     new_obj->value.pair.car = head;
     new_obj->value.pair.cdr = tail;
     return new_obj;
@@ -158,40 +548,44 @@ Object *cons(Object *head, Object *tail)
 Object *list(int argc, Object *argv[]) 
 {
     Object *res_list = nill;
+    for(int i=0; i < argc; i++) {
+        PROTECT(argv[i]);
+    }
     for(int i=argc-1; i >= 0; i--) {
         res_list = cons(argv[i], res_list);
     }
+    UNPROTECT(argc);
     return res_list;
 }
 
 char is_pair(Object *obj) 
 {
-    return obj->type == PAIR;
+    return has_type(obj, PAIR);
 }
 
 char is_atom(Object *obj) 
 {
-    return obj->type != PAIR;
+    return !has_type(obj, PAIR);
 }
 
-char is_integer(Object *obj)
+char is_char(Object *obj)
 {
-    return obj->type == INT;
+    return ((uintptr_t)obj & TAG_MASK) == CHAR_TAG;
 }
 
-char is_number(Object *obj)
+char is_boolean(Object *obj)
 {
-    return is_integer(obj);
+    return obj == true_obj || obj == false_obj;
 }
 
 char is_string(Object *obj)
 {
-    return obj->type == STRING;
+    return has_type(obj, STRING);
 }
 
 char is_symbol(Object *obj)
 {
-    return obj->type == SYMBOL;
+    return has_type(obj, SYMBOL);
 }
 
 char is_nill(Object *obj)
@@ -199,6 +593,16 @@ char is_nill(Object *obj)
     return obj == nill;
 }
 
+char is_local_ref(Object *obj)
+{
+    return has_type(obj, LOCAL_REF);
+}
+
+char is_global_ref(Object *obj)
+{
+    return has_type(obj, GLOBAL_REF);
+}
+
 char is_list(Object *obj)
 {
     if (is_nill(obj)) {
@@ -209,13 +613,56 @@ char is_list(Object *obj)
     }
 }
 
+Object *reverse(Object *list)
+{
+    PROTECT(list);
+    Object *result = nill;
+    PROTECT(result);
+    while (!is_nill(list)) {
+        result = cons(car(list), result);
+        list = cdr(list);
+    }
+    UNPROTECT(2);
+    return result;
+}
+
+int list_length(Object *list)
+{
+    int length = 0;
+    for (; is_pair(list); list = cdr(list))
+        length++;
+    return length;
+}
+
+Object *list_ref(Object *list, int index)
+{
+    while (index-- > 0)
+        list = cdr(list);
+    return car(list);
+}
+
+// Position of obj in list, or -1.
+int list_index(Object *obj, Object *list)
+{
+    for (int i = 0; !is_nill(list); i++, list = cdr(list)) {
+        if (car(list) == obj)
+            return i;
+    }
+    return -1;
+}
+
 Object *map(Object* (*fun)(Object*), Object *list)
 {
     if (is_nill(list)) {
         return nill;
     }
     else {
-        return cons(fun(car(list)), map(fun, cdr(list)));
+        PROTECT(list);
+        Object *head = fun(car(list));
+        PROTECT(head);
+        Object *tail = map(fun, cdr(list));
+        UNPROTECT(2);
+        return cons(head, tail);
     }
 }
 
@@ -226,624 +673,6199 @@ Object *map_in_env(Object* (*fun)(Object*, Object*), Object *list, Object *env)
         return nill;
     }
     else {
-        return cons(fun(car(list), env), map_in_env(fun, cdr(list), env));
+        PROTECT(list);
+        PROTECT(env);
+        Object *head = fun(car(list), env);
+        PROTECT(head);
+        Object *tail = map_in_env(fun, cdr(list), env);
+        UNPROTECT(3);
+        return cons(head, tail);
     }
 }
 
-char eq(Object *obj_a, Object *obj_b)
+// ...............................Numbers.....................................
+// Integers are fixnums until a result leaves fixnum range and then become
+// bignums: a sign and a little-endian magnitude of 32-bit digits with no
+// leading zero digit. A bignum is never small enough to be a fixnum, so
+// results are demoted as soon as they fit. Flonums are boxed doubles, and
+// any operation involving one gives a flonum. Fixnum arithmetic itself is
+// in c_scheme.h.
+#define KARATSUBA_THRESHOLD 32
+
+char is_bignum(Object *obj)
 {
-    if (obj_a->type != obj_b->type)
-        return 0;
-    switch (obj_a->type) {
-        case NILL:
-            return 1;
-        case INT:
-            return (obj_a->value.integer == obj_b->value.integer);
-        case CHAR:
-            return (obj_a->value.character == obj_b->value.character);
-        case FUNCTION:
-            return (obj_a->value.function == obj_b->value.function);
-        case STRING:
-            return strcmp(obj_a->value.string, obj_b->value.string) == 0;
-        case SYMBOL:
-            return strcmp(obj_a->value.symbol, obj_b->value.symbol) == 0;
-        case PAIR:
-            return eq(car(obj_a), car(obj_b)) && eq(cdr(obj_a), cdr(obj_b));
-    }
+    return has_type(obj, BIGNUM);
 }
 
-Object *wrapped_eq(Object *pair)
+char is_flonum(Object *obj)
+{
+    return has_type(obj, FLONUM);
+}
+
+Object *new_flonum(double d)
+{
+    Object *new_obj = alloc_object(FLONUM);
+    new_obj->value.flonum = d;
+    return new_obj;
+}
+
+// ..........Magnitudes: arrays of 32-bit digits, least significant first
+
+static inline int mag_length(const uint32_t *a, int n)
 {
-    Object *obj_a = car(pair);
-    Object *obj_b = cadr(pair);
-    return eq(obj_a, obj_b) ? &true_sym : &false_sym;
+    while (n > 0 && a[n - 1] == 0)
+        n--;
+    return n;
 }
 
-Object *numerical_eq(Object *pair)
+int mag_compare(const uint32_t *a, int an, const uint32_t *b, int bn)
 {
-    Object *num_a = car(pair);
-    Object *num_b = cadr(pair);
-    if (!(is_integer(num_a) && is_integer(num_b))) {
-        printf("ERROR: numerical_eq applied to non-number.");
-        return &false_sym;
+    an = mag_length(a, an);
+    bn = mag_length(b, bn);
+    if (an != bn)
+        return an < bn ? -1 : 1;
+    for (int i = an - 1; i >= 0; i--) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
     }
-    else
-        return num_a->value.integer == num_b->value.integer ? &true_sym : &false_sym;
+    return 0;
 }
 
-Object *numerical_lt(Object *pair)
+// r += a, where r has room for any carry out of a.
+void mag_add_into(uint32_t *r, int rn, const uint32_t *a, int an)
 {
-    Object *num_a = car(pair);
-    Object *num_b = cadr(pair);
-    if (!(is_integer(num_a) && is_integer(num_b))) {
-        printf("ERROR: numerical_lt applied to non-number.");
-        return &false_sym;
+    uint64_t carry = 0;
+    int i = 0;
+    for (; i < an; i++) {
+        carry += (uint64_t)r[i] + a[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    for (; carry && i < rn; i++) {
+        carry += r[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
     }
-    else
-        return num_a->value.integer < num_b->value.integer ? &true_sym : &false_sym;
 }
 
-Object *numerical_gt(Object *pair)
+// r -= a, where r >= a.
+void mag_sub_into(uint32_t *r, int rn, const uint32_t *a, int an)
 {
-    Object *num_a = car(pair);
-    Object *num_b = cadr(pair);
-    if (!(is_integer(num_a) && is_integer(num_b))) {
-        printf("ERROR: numerical_gt applied to non-number.");
-        return &false_sym;
+    int64_t borrow = 0;
+    int i = 0;
+    for (; i < an; i++) {
+        borrow += (int64_t)r[i] - a[i];
+        r[i] = (uint32_t)borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+    for (; borrow && i < rn; i++) {
+        borrow += r[i];
+        r[i] = (uint32_t)borrow;
+        borrow = borrow < 0 ? -1 : 0;
     }
-    else
-        return num_a->value.integer > num_b->value.integer ? &true_sym : &false_sym;
 }
 
-char is_tagged_list(Object *tag, Object *obj) 
+// r = a * b by schoolbook multiplication; r holds an + bn zeroed digits.
+void mag_mul_schoolbook(const uint32_t *a, int an, const uint32_t *b, int bn, uint32_t *r)
 {
-    return (is_pair(obj) && eq(car(obj), tag));
+    for (int i = 0; i < an; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < bn; j++) {
+            carry += (uint64_t)a[i] * b[j] + r[i + j];
+            r[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        r[i + bn] = (uint32_t)carry;
+    }
 }
 
-char is_primitive_procedure(Object *list)
+// r = a * b, r holding an + bn zeroed digits. Operands that are both long
+// are split in halves and multiplied with three recursive products instead
+// of four (Karatsuba): with a = a1 B + a0 and b = b1 B + b0,
+// a b = z2 B^2 + ((a0 + a1)(b0 + b1) - z2 - z0) B + z0.
+void mag_mul(const uint32_t *a, int an, const uint32_t *b, int bn, uint32_t *r)
 {
-    return is_tagged_list(primitive_procedure_tag, list);
+    an = mag_length(a, an);
+    bn = mag_length(b, bn);
+    if (an < bn) {
+        const uint32_t *t = a; a = b; b = t;
+        int tn = an; an = bn; bn = tn;
+    }
+    if (bn < KARATSUBA_THRESHOLD) {
+        mag_mul_schoolbook(a, an, b, bn, r);
+        return;
+    }
+    int m = an / 2;
+    if (bn <= m) {
+        // b is short: r = a0 b + a1 b B^m
+        uint32_t *high = calloc(an - m + bn, sizeof(uint32_t));
+        mag_mul(a, m, b, bn, r);
+        mag_mul(a + m, an - m, b, bn, high);
+        mag_add_into(r + m, an + bn - m, high, an - m + bn);
+        free(high);
+        return;
+    }
+    int a1n = an - m, b1n = bn - m;
+    int sum_n = a1n + 1;
+    uint32_t *a_sum = calloc(sum_n, sizeof(uint32_t));
+    uint32_t *b_sum = calloc(sum_n, sizeof(uint32_t));
+    memcpy(a_sum, a + m, a1n * sizeof(uint32_t));
+    mag_add_into(a_sum, sum_n, a, m);
+    memcpy(b_sum, b + m, b1n * sizeof(uint32_t));
+    mag_add_into(b_sum, sum_n, b, m);
+    uint32_t *z0 = calloc(2 * m, sizeof(uint32_t));
+    uint32_t *z2 = calloc(a1n + b1n, sizeof(uint32_t));
+    uint32_t *z1 = calloc(2 * sum_n, sizeof(uint32_t));
+    mag_mul(a, m, b, m, z0);
+    mag_mul(a + m, a1n, b + m, b1n, z2);
+    mag_mul(a_sum, sum_n, b_sum, sum_n, z1);
+    mag_sub_into(z1, 2 * sum_n, z0, 2 * m);
+    mag_sub_into(z1, 2 * sum_n, z2, a1n + b1n);
+    memcpy(r, z0, 2 * m * sizeof(uint32_t));
+    memcpy(r + 2 * m, z2, (a1n + b1n) * sizeof(uint32_t));
+    mag_add_into(r + m, an + bn - m, z1, mag_length(z1, 2 * sum_n));
+    free(a_sum);
+    free(b_sum);
+    free(z0);
+    free(z1);
+    free(z2);
 }
 
-Object *primitive_procedure(Object *list)
+// Divides a in place by a single digit and returns the remainder.
+uint32_t mag_div_digit(uint32_t *a, int an, uint32_t divisor)
 {
-    return cadr(list);
+    uint64_t remainder = 0;
+    for (int i = an - 1; i >= 0; i--) {
+        remainder = (remainder << 32) | a[i];
+        a[i] = (uint32_t)(remainder / divisor);
+        remainder %= divisor;
+    }
+    return (uint32_t)remainder;
 }
 
-char is_compound_procedure(Object *list)
+// a = a * factor + addend, where a has room for the extra digit.
+void mag_mul_digit_add(uint32_t *a, int an, uint32_t factor, uint32_t addend)
 {
-    return is_tagged_list(compound_procedure_tag, list);
+    uint64_t carry = addend;
+    for (int i = 0; i < an; i++) {
+        carry += (uint64_t)a[i] * factor;
+        a[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
 }
 
-Object *procedure_params(Object *compound_proc)
+// ..........Integers
+
+// Takes ownership of digits, a malloced magnitude, and returns the integer
+// it denotes, as a fixnum whenever it fits.
+Object *make_integer(int sign, uint32_t *digits, int length)
 {
-    return cadr(compound_proc);
+    length = mag_length(digits, length);
+    if (length <= 2) {
+        uint64_t magnitude = length == 0 ? 0 : digits[0];
+        if (length == 2)
+            magnitude |= (uint64_t)digits[1] << 32;
+        if (sign > 0 ? magnitude <= (uint64_t)FIXNUM_MAX : magnitude <= -(uint64_t)FIXNUM_MIN) {
+            free(digits);
+            return new_int(sign > 0 ? (intptr_t)magnitude : -(intptr_t)magnitude);
+        }
+    }
+    Object *new_obj = alloc_object(BIGNUM);
+    new_obj->value.bignum.sign = sign;
+    new_obj->value.bignum.length = length;
+    new_obj->value.bignum.digits = digits;
+    return new_obj;
 }
 
-Object *procedure_body(Object *compound_proc)
+// An int64_t as a fixnum, or as a bignum when out of fixnum range.
+Object *integer_from_int64(int64_t value)
 {
-    return caddr(compound_proc);
+    if (value >= FIXNUM_MIN && value <= FIXNUM_MAX)
+        return new_int(value);
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    uint32_t *digits = malloc(2 * sizeof(uint32_t));
+    digits[0] = (uint32_t)magnitude;
+    digits[1] = (uint32_t)(magnitude >> 32);
+    return make_integer(value < 0 ? -1 : 1, digits, 2);
 }
 
-Object *procedure_environment(Object *compound_proc)
+// Whether n is an exact integer that fits in an int64_t, stored in *value
+// if it does.
+char integer_to_int64(Object *n, int64_t *value)
 {
-    return cadddr(compound_proc);
+    if (is_fixnum(n)) {
+        *value = fixnum_value(n);
+        return 1;
+    }
+    if (!is_bignum(n) || n->value.bignum.length > 2)
+        return 0;
+    uint64_t magnitude = n->value.bignum.digits[0];
+    if (n->value.bignum.length == 2)
+        magnitude |= (uint64_t)n->value.bignum.digits[1] << 32;
+    if (n->value.bignum.sign > 0 ? magnitude > (uint64_t)INT64_MAX
+                                 : magnitude > (uint64_t)INT64_MAX + 1)
+        return 0;
+    *value = n->value.bignum.sign > 0 ? (int64_t)magnitude : (int64_t)(0 - magnitude);
+    return 1;
 }
 
-Object *make_compound_procedure(Object *params, Object *body, Object *environment)
+// The sign and magnitude of an integer. A fixnum's magnitude is written to
+// the two-digit buffer small.
+const uint32_t *integer_digits(Object *n, uint32_t small[2], int *length, int *sign)
 {
-    Object *argv[] = {compound_procedure_tag, params, body, environment};
-    return list(4, argv);
+    if (is_fixnum(n)) {
+        intptr_t value = fixnum_value(n);
+        uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+        *sign = value < 0 ? -1 : 1;
+        small[0] = (uint32_t)magnitude;
+        small[1] = (uint32_t)(magnitude >> 32);
+        *length = mag_length(small, 2);
+        return small;
+    }
+    *sign = n->value.bignum.sign;
+    *length = n->value.bignum.length;
+    return n->value.bignum.digits;
 }
 
-// .................................Reader....................................
-char delim(char c) 
+// a + b_sign * b for integers a and b.
+Object *integer_add(Object *a, Object *b, int b_sign)
 {
-    return (c == '(') || (c == ')') || (c == ' ') || (c == '\'');
+    uint32_t a_small[2], b_small[2];
+    int an, bn, a_sign, b_sign_of;
+    const uint32_t *ad = integer_digits(a, a_small, &an, &a_sign);
+    const uint32_t *bd = integer_digits(b, b_small, &bn, &b_sign_of);
+    b_sign *= b_sign_of;
+    int rn = (an > bn ? an : bn) + 1;
+    uint32_t *r = calloc(rn, sizeof(uint32_t));
+    if (a_sign == b_sign) {
+        memcpy(r, ad, an * sizeof(uint32_t));
+        mag_add_into(r, rn, bd, bn);
+        return make_integer(a_sign, r, rn);
+    }
+    if (mag_compare(ad, an, bd, bn) >= 0) {
+        memcpy(r, ad, an * sizeof(uint32_t));
+        mag_sub_into(r, rn, bd, bn);
+        return make_integer(a_sign, r, rn);
+    }
+    memcpy(r, bd, bn * sizeof(uint32_t));
+    mag_sub_into(r, rn, ad, an);
+    return make_integer(b_sign, r, rn);
 }
 
-void tokenize_string(char *s, char toks[][MAX_TOK_LEN])
+// a / b for integers a and b, b nonzero, or NULL when b does not divide a.
+// A one-digit divisor takes mag_div_digit; longer ones are divided a bit of
+// a at a time, shifting it into the remainder and subtracting b where it
+// fits.
+Object *integer_exact_quotient(Object *a, Object *b)
 {
-    if (!*s) {
-        printf("Exiting.\n");
-        exit(0);
+    uint32_t a_small[2], b_small[2];
+    int an, bn, a_sign, b_sign;
+    const uint32_t *ad = integer_digits(a, a_small, &an, &a_sign);
+    const uint32_t *bd = integer_digits(b, b_small, &bn, &b_sign);
+    uint32_t *q = calloc(an + 1, sizeof(uint32_t));
+    char exact;
+    if (bn == 1) {
+        memcpy(q, ad, an * sizeof(uint32_t));
+        exact = mag_div_digit(q, an, bd[0]) == 0;
     }
-    char c;
-    char *t;
-    char *tok_start;
-    size_t n = strlen(s);
-    size_t i = 0;
-    size_t j = 0;
-    while (*s) {
-        while (*s == ' ')
-            ++s;
-        if (*s == '\'') {
-            strcpy(*toks++, "'");
-            ++s;
-        }
-        if (*s == '(') {
-            strcpy(*toks++, "(");
-            ++s;
-        }
-        else if (*s == ')') {
-            strcpy(*toks++, ")");
-            ++s;
-        }
-        else if (*s == '"') {
-            tok_start = *toks++;
-            *tok_start++ = '"';
-            ++s;
-            while (*s && (*s != '"')) {
-                *tok_start++ = *s++;
-            }
-            if (*s != '"') {
-                printf("ERROR: missing closing \"\n");
-                exit(1);
+    else {
+        uint32_t *r = calloc(bn + 1, sizeof(uint32_t));
+        for (int i = 32 * an - 1; i >= 0; i--) {
+            uint32_t carry = (ad[i / 32] >> (i % 32)) & 1;
+            for (int k = 0; k <= bn; k++) {
+                uint32_t top = r[k] >> 31;
+                r[k] = (r[k] << 1) | carry;
+                carry = top;
             }
-            ++s;
-            *tok_start++ = '"';
-            *tok_start = '\0';
-        }
-        else {
-            tok_start = *toks++;
-            while (*s && !delim(*s)) {
-                *tok_start++ = *s++;
+            if (mag_compare(r, bn + 1, bd, bn) >= 0) {
+                mag_sub_into(r, bn + 1, bd, bn);
+                q[i / 32] |= (uint32_t)1 << (i % 32);
             }
-            *tok_start = '\0';
         }
+        exact = mag_length(r, bn + 1) == 0;
+        free(r);
     }
+    if (!exact) {
+        free(q);
+        return NULL;
+    }
+    return make_integer(a_sign * b_sign, q, an + 1);
 }
 
-Object *read_atom(char toks[][MAX_TOK_LEN], size_t *curr_index)
+Object *integer_mul(Object *a, Object *b)
 {
-    char *current_tok = toks[*curr_index];
-    char first_char = *current_tok;
-    *curr_index = *curr_index + 1;
-    if (((first_char=='-') 
-                && (strlen(current_tok)>0) 
-                && isdigit(*(current_tok+1)) )
-            || isdigit(first_char)) {
-        return new_int(atoi(current_tok));
-    }
-    else if (first_char=='"') {
-        return new_string(current_tok);
-    }
-    else  {
-        return new_symbol(current_tok);
-    }
+    uint32_t a_small[2], b_small[2];
+    int an, bn, a_sign, b_sign;
+    const uint32_t *ad = integer_digits(a, a_small, &an, &a_sign);
+    const uint32_t *bd = integer_digits(b, b_small, &bn, &b_sign);
+    uint32_t *r = calloc(an + bn + 1, sizeof(uint32_t));
+    mag_mul(ad, an, bd, bn, r);
+    return make_integer(a_sign * b_sign, r, an + bn + 1);
 }
 
-Object *read(char toks[][MAX_TOK_LEN], size_t *curr_index);
-Object *read_pair(char toks[][MAX_TOK_LEN], size_t *curr_index)
+int integer_compare(Object *a, Object *b)
 {
-    if (strcmp(toks[*curr_index], ")") == 0) {
-        *curr_index = *curr_index + 1;
-        return nill;
-    }
-    else {
-        Object *head = read(toks, curr_index);
-        Object *tail = read_pair(toks, curr_index);
-        return cons(head, tail);
-    }
+    uint32_t a_small[2], b_small[2];
+    int an, bn, a_sign, b_sign;
+    const uint32_t *ad = integer_digits(a, a_small, &an, &a_sign);
+    const uint32_t *bd = integer_digits(b, b_small, &bn, &b_sign);
+    if (an == 0 && bn == 0)
+        return 0;
+    if (a_sign != b_sign)
+        return a_sign;
+    return a_sign * mag_compare(ad, an, bd, bn);
 }
 
-Object *read(char toks[][MAX_TOK_LEN], size_t *curr_index)
+// Parses an optionally signed run of decimal digits.
+Object *parse_integer(char *s)
 {
-    if (strcmp(toks[*curr_index], "'") == 0) {
-        *curr_index = *curr_index + 1;
-        Object *expr = read(toks, curr_index);
-        return cons(&quote_sym, cons(expr, nill));
-    }
-    if (strcmp(toks[*curr_index], "(") == 0) {
-        *curr_index = *curr_index + 1;
-        return read_pair(toks, curr_index);
+    int sign = 1;
+    if (*s == '-' || *s == '+')
+        sign = *s++ == '-' ? -1 : 1;
+    size_t ndigits = strlen(s);
+    int length = ndigits / 9 + 2;
+    uint32_t *digits = calloc(length, sizeof(uint32_t));
+    // nine decimal digits at a time, the first chunk taking the remainder
+    size_t chunk = ndigits % 9 ? ndigits % 9 : 9;
+    while (*s) {
+        uint32_t value = 0;
+        uint32_t scale = 1;
+        for (size_t i = 0; i < chunk; i++, s++) {
+            value = value * 10 + (*s - '0');
+            scale *= 10;
+        }
+        mag_mul_digit_add(digits, length, scale, value);
+        chunk = 9;
     }
-    else
-        return read_atom(toks, curr_index);
+    return make_integer(sign, digits, length);
 }
-// ...................Interpreter Data Structures..............................
-// Association list - pair of list or list of pairs?
-// Environment list of assoc lists: (most-recent, parent, ..., global-env, empty)
-Object *the_empty_environment;
-Object *the_global_environment;
 
-Object *zip(Object *list_a, Object *list_b) {
-    if (is_nill(list_a) || is_nill(list_b)) {
-        return nill;
-    } else {
-        return cons(cons(car(list_a), car(list_b)),
-                zip(cdr(list_a), cdr(list_b)));
-    }
+// ..........Generic arithmetic
+
+char is_number(Object *obj)
+{
+    return is_fixnum(obj) || is_bignum(obj) || is_flonum(obj);
+}
+
+double number_to_double(Object *n)
+{
+    if (is_fixnum(n))
+        return (double)fixnum_value(n);
+    if (is_flonum(n))
+        return n->value.flonum;
+    double d = 0;
+    for (int i = n->value.bignum.length - 1; i >= 0; i--)
+        d = d * 4294967296.0 + n->value.bignum.digits[i];
+    return n->value.bignum.sign * d;
+}
+
+Object *number_add(Object *a, Object *b)
+{
+    Object *result;
+    if (is_fixnum(a) && is_fixnum(b) && fixnum_add(a, b, &result))
+        return result;
+    if (is_flonum(a) || is_flonum(b))
+        return new_flonum(number_to_double(a) + number_to_double(b));
+    return integer_add(a, b, 1);
 }
 
-Object *(*new_environment)(Object*, Object*) = cons;
-Object *extend_environment(Object *params, Object *vals, Object *parent_env)
+Object *number_sub(Object *a, Object *b)
 {
-    Object *bindings = zip(params, vals);
-    return new_environment(bindings, parent_env);
+    Object *result;
+    if (is_fixnum(a) && is_fixnum(b) && fixnum_sub(a, b, &result))
+        return result;
+    if (is_flonum(a) || is_flonum(b))
+        return new_flonum(number_to_double(a) - number_to_double(b));
+    return integer_add(a, b, -1);
 }
 
-Object* (*first_frame)(Object*) = car;
-Object* (*parent_env)(Object*) = cdr;
+Object *number_mul(Object *a, Object *b)
+{
+    Object *result;
+    if (is_fixnum(a) && is_fixnum(b) && fixnum_mul(a, b, &result))
+        return result;
+    if (is_flonum(a) || is_flonum(b))
+        return new_flonum(number_to_double(a) * number_to_double(b));
+    return integer_mul(a, b);
+}
 
-Object* lookup_variable(Object *name, Object *environment)
+// There are no rationals: an integer quotient that is not exact is a
+// flonum. Dividing by an exact zero is an error.
+Object *number_div(Object *a, Object *b)
 {
-    if (eq(environment, the_empty_environment)) {
-        printf("ERROR: %s not defined.", name->value.symbol);
+    if (b == new_int(0)) {
+        report_error("/ by exact zero.");
         return nill;
     }
-    Object *frame = first_frame(environment);
-    Object *this_binding;
-    Object *val;
-    while (!is_nill(frame)) {
-        this_binding = car(frame);
-        if (eq(car(this_binding), name)) {
-            val = cdr(this_binding);
-            return val;
-        }
-        else {
-            frame = cdr(frame);
-        }
+    if (is_fixnum(a) && is_fixnum(b)) {
+        // the quotient of FIXNUM_MIN by -1 leaves fixnum range
+        if (fixnum_value(a) % fixnum_value(b) == 0)
+            return integer_from_int64(fixnum_value(a) / fixnum_value(b));
     }
-    return lookup_variable(name, parent_env(environment));
+    else if (!is_flonum(a) && !is_flonum(b)) {
+        Object *quotient = integer_exact_quotient(a, b);
+        if (quotient)
+            return quotient;
+    }
+    return new_flonum(number_to_double(a) / number_to_double(b));
 }
 
-void define_variable(Object *variable, Object *value, Object *environment) 
+// -1, 0 or 1 as a is less than, equal to or greater than b, or UNORDERED
+// when either is a NaN, which makes =, < and > all false.
+#define UNORDERED 2
+
+int number_compare(Object *a, Object *b)
 {
-    Object *frame = first_frame(environment);
-    Object *this_binding;
-    while (!is_nill(frame)) {
-        this_binding = car(frame);
-        if (eq(car(this_binding), variable)) {
-            set_cdr(this_binding, value);
-            return;
-        }
-        else {
-            frame = cdr(frame);
-        }
+    if (is_fixnum(a) && is_fixnum(b))
+        return ((intptr_t)a > (intptr_t)b) - ((intptr_t)a < (intptr_t)b);
+    if (is_flonum(a) || is_flonum(b)) {
+        double x = number_to_double(a), y = number_to_double(b);
+        if (x != x || y != y)
+            return UNORDERED;
+        return (x > y) - (x < y);
     }
-    Object *new_binding = cons(variable, value);
-    set_car(environment, cons(new_binding, first_frame(environment)));
+    return integer_compare(a, b);
 }
 
-// ..............................Builtins......................................
-Object *add(Object *arg_list)
+Object *numerical_eq(int argc, Object **argv)
 {
-    if (is_integer(arg_list)) {
-        return arg_list;
-    }
-    long acc = 0;
-    while (!eq(arg_list, nill)) {
-        acc += car(arg_list)->value.integer;
-        arg_list = cdr(arg_list);
+    Object *num_a = argv[0];
+    Object *num_b = argv[1];
+    if (!(is_number(num_a) && is_number(num_b))) {
+        report_error("numerical_eq applied to non-number.");
+        return false_obj;
     }
-    return new_int(acc);
+    else
+        return new_boolean(number_compare(num_a, num_b) == 0);
 }
 
-Object *mul(Object *arg_list)
+Object *numerical_lt(int argc, Object **argv)
 {
-    if (is_integer(arg_list)) {
-        return arg_list;
-    }
-    long acc = 1;
-    while (!eq(arg_list, nill)) {
-        acc *= car(arg_list)->value.integer;
-        arg_list = cdr(arg_list);
+    Object *num_a = argv[0];
+    Object *num_b = argv[1];
+    if (!(is_number(num_a) && is_number(num_b))) {
+        report_error("numerical_lt applied to non-number.");
+        return false_obj;
     }
-    return new_int(acc);
+    else
+        return new_boolean(number_compare(num_a, num_b) == -1);
 }
 
-
-Object *sub(Object *arg_list)
+Object *numerical_gt(int argc, Object **argv)
 {
-    if (is_integer(arg_list)) {
-        return new_int(-1 * arg_list->value.integer);
+    Object *num_a = argv[0];
+    Object *num_b = argv[1];
+    if (!(is_number(num_a) && is_number(num_b))) {
+        report_error("numerical_gt applied to non-number.");
+        return false_obj;
     }
-    long acc = car(arg_list)->value.integer;
-    arg_list = cdr(arg_list);
-    while (!eq(arg_list, nill)) {
-        acc -= car(arg_list)->value.integer;
-        arg_list = cdr(arg_list);
-    }
-    return new_int(acc);
+    else
+        return new_boolean(number_compare(num_a, num_b) == 1);
 }
 
-Object *cons_on_list(Object  *arg_list)
+// ...............................Vectors.....................................
+// A vector keeps its elements in the cells after its header, like a frame
+// keeps its slots. VECTOR elements are objects; S64VECTOR and F64VECTOR
+// elements are raw int64_t and double, so numeric data costs 8 bytes an
+// element and loops over it never touch the heap.
+char is_vector(Object *obj)
 {
-    Object *head = car(arg_list);
-    Object *tail = cadr(arg_list);
-    return cons(head, tail);
+    return has_type(obj, VECTOR);
 }
 
-Object *make_primitive_procedure(Object *proc)
+char is_s64vector(Object *obj)
 {
-    Object *argv[] = {primitive_procedure_tag, proc};
-    return list(2, argv);
+    return has_type(obj, S64VECTOR);
 }
 
-Object *load_builtins(void)
+char is_f64vector(Object *obj)
 {
-    Object *bindings[] = {
-            cons(new_symbol("+"), make_primitive_procedure(new_function(add))),
-            cons(new_symbol("*"), make_primitive_procedure(new_function(mul))),
-            cons(new_symbol("-"), make_primitive_procedure(new_function(sub))),
-            cons(new_symbol("="), make_primitive_procedure(new_function(numerical_eq))),
-            cons(new_symbol(">"), make_primitive_procedure(new_function(numerical_gt))),
-            cons(new_symbol("<"), make_primitive_procedure(new_function(numerical_lt))),
-            cons(new_symbol("eq"), make_primitive_procedure(new_function(wrapped_eq))),
-            cons(new_symbol("cons"), make_primitive_procedure(new_function(cons_on_list))),
-            cons(new_symbol("car"), make_primitive_procedure(new_function(car))),
-            cons(new_symbol("cdr"), make_primitive_procedure(new_function(cdr)))};
-
-    Object *binding_list = list(sizeof(bindings)/sizeof(bindings[0]), bindings);
-    return new_environment(binding_list, the_empty_environment);
+    return has_type(obj, F64VECTOR);
 }
 
-// .......................Syntax manipulation..................................
-char is_lambda(Object *expr) 
+char is_any_vector(Object *obj)
 {
-    return is_tagged_list(&lambda_sym, expr);
+    return is_vector(obj) || is_s64vector(obj) || is_f64vector(obj);
 }
 
-Object *lambda_params(Object *lambda_definition)
+static inline Object **vector_elements(Object *vector)
 {
-    return cadr(lambda_definition);
+    return (Object**)(vector + 1);
 }
 
-Object *lambda_body(Object *lambda_definition)
+static inline int64_t *s64vector_elements(Object *vector)
 {
-    return cddr(lambda_definition);
+    return (int64_t*)(vector + 1);
 }
 
-Object *make_lambda(Object *lambda_params, Object *lambda_body)
+static inline double *f64vector_elements(Object *vector)
 {
-    return cons(&lambda_sym, cons(lambda_params, lambda_body));
+    return (double*)(vector + 1);
 }
 
-char is_definition(Object *expr) 
+static inline size_t vector_length(Object *vector)
 {
-    return is_tagged_list(&define_sym, expr);
+    return vector->value.vector.length;
 }
 
-Object *definition_variable(Object *expr)
+// The longest vector make-<kind> tries to allocate, capped like strings so
+// that its size in bytes cannot overflow.
+#define MAX_VECTOR_LENGTH UINT32_MAX
+
+// All three element types are 8 bytes wide. The elements are left for the
+// caller to fill in, except that an object vector starts out all (). Gives
+// NULL if there is no memory for them.
+Object *new_vector(ObjectType type, size_t length)
+{
+    size_t element_cells = (length * sizeof(Object*) + sizeof(Object) - 1) / sizeof(Object);
+    Object *new_obj = try_alloc_cells(type, 1 + element_cells);
+    if (!new_obj)
+        return NULL;
+    new_obj->value.vector.length = length;
+    if (type == VECTOR) {
+        Object **elements = vector_elements(new_obj);
+        for (size_t i = 0; i < length; i++)
+            elements[i] = nill;
+    }
+    return new_obj;
+}
+
+// Sums with four independent accumulators, so the loop carries no single
+// dependency chain and the compiler can keep it in vector registers.
+double f64_sum(const double *x, size_t n)
+{
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += x[i];
+        s1 += x[i + 1];
+        s2 += x[i + 2];
+        s3 += x[i + 3];
+    }
+    for (; i < n; i++)
+        s0 += x[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+double f64_dot(const double *x, const double *y, size_t n)
+{
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += x[i] * y[i];
+        s1 += x[i + 1] * y[i + 1];
+        s2 += x[i + 2] * y[i + 2];
+        s3 += x[i + 3] * y[i + 3];
+    }
+    for (; i < n; i++)
+        s0 += x[i] * y[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+char is_tagged_list(Object *tag, Object *obj) 
+{
+    return (is_pair(obj) && car(obj) == tag);
+}
+
+// ..........Equivalence
+// eq? is pointer identity: symbols are interned and fixnums, characters and
+// constants are immediates, so it is all the evaluator itself ever needs.
+// eqv? also equates numbers of the same exactness and value.
+char is_eqv(Object *obj_a, Object *obj_b)
+{
+    if (obj_a == obj_b)
+        return 1;
+    if (!is_heap_object(obj_a) || !is_heap_object(obj_b) || obj_a->type != obj_b->type)
+        return 0;
+    switch (obj_a->type) {
+        case BIGNUM:
+            return integer_compare(obj_a, obj_b) == 0;
+        case FLONUM:
+            // the same bits, so 0.0 and -0.0 differ and a NaN is eqv? to itself
+            return memcmp(&obj_a->value.flonum, &obj_b->value.flonum, sizeof(double)) == 0;
+        default:
+            return 0;
+    }
+}
+
+// Pairs of objects still to be compared by is_equal. Nothing allocates on the
+// Scheme heap during a comparison, so the stack need not be a GC root.
+Object **equal_stack;
+size_t equal_stack_size;
+
+// equal? compares pairs, vectors and strings by content. The walk keeps its
+// own stack, so long lists cost no C stack, and shares with eqv? the quick
+// exit on identical pointers at every level.
+char is_equal(Object *obj_a, Object *obj_b)
+{
+    size_t sp = 0;
+    for (;;) {
+        if (!is_eqv(obj_a, obj_b)) {
+            if (!is_heap_object(obj_a) || !is_heap_object(obj_b) || obj_a->type != obj_b->type)
+                return 0;
+            size_t pending = 0;
+            switch (obj_a->type) {
+                case STRING:
+                    if (!string_equal(obj_a, obj_b))
+                        return 0;
+                    break;
+                case PAIR:
+                case VECTOR:
+                    pending = obj_a->type == PAIR ? 2 : vector_length(obj_a);
+                    if (obj_a->type == VECTOR && pending != vector_length(obj_b))
+                        return 0;
+                    if (sp + 2 * pending > equal_stack_size) {
+                        equal_stack_size = 2 * (sp + 2 * pending);
+                        equal_stack = realloc(equal_stack, equal_stack_size * sizeof(Object*));
+                    }
+                    // pushed last to first so that cars and earlier elements
+                    // are compared first
+                    for (size_t i = pending; i-- > 0;) {
+                        equal_stack[sp++] = obj_a->type == PAIR ? (i ? cdr(obj_a) : car(obj_a))
+                                                                : vector_elements(obj_a)[i];
+                        equal_stack[sp++] = obj_b->type == PAIR ? (i ? cdr(obj_b) : car(obj_b))
+                                                                : vector_elements(obj_b)[i];
+                    }
+                    break;
+                case S64VECTOR:
+                case F64VECTOR:
+                    if (vector_length(obj_a) != vector_length(obj_b))
+                        return 0;
+                    for (size_t i = 0; i < vector_length(obj_a); i++) {
+                        if (obj_a->type == S64VECTOR
+                                ? s64vector_elements(obj_a)[i] != s64vector_elements(obj_b)[i]
+                                : f64vector_elements(obj_a)[i] != f64vector_elements(obj_b)[i])
+                            return 0;
+                    }
+                    break;
+                default:
+                    return 0;
+            }
+        }
+        if (sp == 0)
+            return 1;
+        obj_b = equal_stack[--sp];
+        obj_a = equal_stack[--sp];
+    }
+}
+
+Object *is_eq_procedure(int argc, Object **argv)
+{
+    return new_boolean(argv[0] == argv[1]);
+}
+
+Object *is_eqv_procedure(int argc, Object **argv)
+{
+    return new_boolean(is_eqv(argv[0], argv[1]));
+}
+
+Object *is_equal_procedure(int argc, Object **argv)
+{
+    return new_boolean(is_equal(argv[0], argv[1]));
+}
+
+// ..........Hash tables
+// A HASHTABLE maps keys to values by open addressing with linear probing,
+// kept at most half full. Keys match when they are eqv? or are strings with
+// the same text. Each entry keeps its key's hash, so probing compares hashes
+// before keys and growing never rehashes. Removal shifts the rest of the
+// probe run back into the hole instead of leaving a tombstone.
+typedef struct HashEntry {
+    Object *key; // NULL if the entry is empty
+    Object *value;
+    unsigned long hash;
+} HashEntry;
+
+typedef struct HashTable {
+    HashEntry *entries;
+    size_t size;
+    size_t count;
+} HashTable;
+
+Object *new_hash_table(void)
+{
+    Object *new_obj = alloc_object(HASHTABLE);
+    HashTable *table = malloc(sizeof(HashTable));
+    table->size = HASH_TABLE_INITIAL_SIZE;
+    table->count = 0;
+    table->entries = calloc(table->size, sizeof(HashEntry));
+    new_obj->value.hash_table = table;
+    return new_obj;
+}
+
+// Consistent with same_key: numbers hash by value, strings and symbols by
+// text, everything else by address.
+unsigned long hash_key(Object *key)
+{
+    if (!is_heap_object(key))
+        return hash_pointer(key);
+    switch (key->type) {
+        case STRING:
+            return string_hash(key);
+        case SYMBOL:
+            return text_hash(key);
+        case FLONUM:
+            return hash_bytes(&key->value.flonum, sizeof(double));
+        case BIGNUM:
+            return hash_bytes(key->value.bignum.digits, key->value.bignum.length * sizeof(uint32_t))
+                   ^ (unsigned long)key->value.bignum.sign;
+        default:
+            return hash_pointer(key);
+    }
+}
+
+static inline char same_key(Object *a, Object *b)
+{
+    return is_eqv(a, b) || (has_type(a, STRING) && has_type(b, STRING) && string_equal(a, b));
+}
+
+// Entry holding key, or the empty entry where it belongs.
+HashEntry *hash_table_entry(HashTable *table, Object *key, unsigned long hash)
+{
+    size_t mask = table->size - 1;
+    size_t i = hash & mask;
+    while (table->entries[i].key
+           && (table->entries[i].hash != hash || !same_key(table->entries[i].key, key)))
+        i = (i + 1) & mask;
+    return &table->entries[i];
+}
+
+void grow_hash_table(HashTable *table)
+{
+    HashEntry *old_entries = table->entries;
+    size_t old_size = table->size;
+    table->size *= 2;
+    table->entries = calloc(table->size, sizeof(HashEntry));
+    size_t mask = table->size - 1;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_entries[i].key) {
+            size_t j = old_entries[i].hash & mask;
+            while (table->entries[j].key)
+                j = (j + 1) & mask;
+            table->entries[j] = old_entries[i];
+        }
+    }
+    free(old_entries);
+}
+
+void hash_table_put(HashTable *table, Object *key, Object *value)
+{
+    unsigned long hash = hash_key(key);
+    HashEntry *entry = hash_table_entry(table, key, hash);
+    entry->value = value;
+    if (!entry->key) {
+        entry->key = key;
+        entry->hash = hash;
+        if (2 * ++table->count > table->size)
+            grow_hash_table(table);
+    }
+}
+
+// Whether key was present.
+char hash_table_remove(HashTable *table, Object *key)
+{
+    HashEntry *entry = hash_table_entry(table, key, hash_key(key));
+    if (!entry->key)
+        return 0;
+    size_t mask = table->size - 1;
+    size_t hole = entry - table->entries;
+    for (size_t i = (hole + 1) & mask; table->entries[i].key; i = (i + 1) & mask) {
+        // an entry can fill the hole unless its home slot lies cyclically in
+        // (hole, i], where probing for it would stop before reaching the hole
+        size_t home = table->entries[i].hash & mask;
+        char reachable = hole < i ? home > hole && home <= i : home > hole || home <= i;
+        if (!reachable) {
+            table->entries[hole] = table->entries[i];
+            hole = i;
+        }
+    }
+    table->entries[hole].key = NULL;
+    table->entries[hole].value = NULL;
+    table->count--;
+    return 1;
+}
+
+// ..........Procedures
+// A PRIMITIVE points at the static descriptor of a builtin. A CLOSURE pairs a
+// lambda template with the environment it closes over; the template is what
+// the execution mode made of the lambda once: the resolved lambda expression
+// for eval, a CODE object for the VM, a lambda NODE for the analyzer, or a
+// NATIVE for a lambda compiled to C with --compile.
+// Templates carry the arity and name, see procedure_arity.
+typedef struct Primitive {
+    char *name;
+    Object* (*function)(int argc, Object **argv);
+    int min_args;
+    int max_args; // -1 for no limit
+} Primitive;
+
+static inline char is_primitive_procedure(Object *obj)
+{
+    return has_type(obj, PRIMITIVE);
+}
+
+static inline char is_closure_of(Object *obj, ObjectType template_type)
+{
+    return has_type(obj, CLOSURE) && type_of(obj->value.closure.lambda) == template_type;
+}
+
+static inline char is_compound_procedure(Object *obj)
+{
+    return is_closure_of(obj, PAIR);
+}
+
+static inline char is_compiled_procedure(Object *obj)
+{
+    return is_closure_of(obj, CODE);
+}
+
+static inline char is_analyzed_procedure(Object *obj)
+{
+    return is_closure_of(obj, NODE);
+}
+
+static inline char is_native_procedure(Object *obj)
+{
+    return is_closure_of(obj, NATIVE);
+}
+
+static inline Object *closure_lambda(Object *closure)
+{
+    return closure->value.closure.lambda;
+}
+
+static inline Object *closure_environment(Object *closure)
+{
+    return closure->value.closure.env;
+}
+
+// .................................Reader....................................
+// Reads one datum at a time from a FILE* (through stdio's own buffering) or
+// from an in-memory buffer. Tokens are collected in a buffer that grows as
+// needed, and a datum may span any number of lines.
+typedef struct Reader {
+    FILE *file;         // NULL when reading from text
+    const char *text;
+    size_t text_length;
+    size_t text_pos;
+    char *token;
+    size_t token_length;
+    size_t token_capacity;
+} Reader;
+
+typedef enum Token {TOK_EOF, TOK_OPEN, TOK_CLOSE, TOK_QUOTE, TOK_STRING, TOK_ATOM} Token;
+
+void init_file_reader(Reader *reader, FILE *file)
+{
+    memset(reader, 0, sizeof(Reader));
+    reader->file = file;
+}
+
+void init_text_reader(Reader *reader, const char *text, size_t length)
+{
+    memset(reader, 0, sizeof(Reader));
+    reader->text = text;
+    reader->text_length = length;
+}
+
+void free_reader(Reader *reader)
+{
+    free(reader->token);
+    reader->token = NULL;
+}
+
+int reader_getc(Reader *reader)
+{
+    if (reader->file)
+        return getc(reader->file);
+    if (reader->text_pos == reader->text_length)
+        return EOF;
+    return (unsigned char)reader->text[reader->text_pos++];
+}
+
+int reader_peek(Reader *reader)
+{
+    if (reader->file) {
+        int c = getc(reader->file);
+        if (c != EOF)
+            ungetc(c, reader->file);
+        return c;
+    }
+    if (reader->text_pos == reader->text_length)
+        return EOF;
+    return (unsigned char)reader->text[reader->text_pos];
+}
+
+void token_push(Reader *reader, char c)
+{
+    if (reader->token_length + 1 >= reader->token_capacity) {
+        reader->token_capacity = reader->token_capacity ? 2 * reader->token_capacity : 64;
+        reader->token = realloc(reader->token, reader->token_capacity);
+    }
+    reader->token[reader->token_length++] = c;
+    reader->token[reader->token_length] = '\0';
+}
+
+char delim(int c) 
+{
+    return c == EOF || isspace(c) || c == '(' || c == ')' || c == '\'' || c == '"' || c == ';';
+}
+
+// Skips whitespace and ; comments, then reads the next token into
+// reader->token.
+Token next_token(Reader *reader)
+{
+    int c;
+    while (1) {
+        c = reader_getc(reader);
+        if (c == ';') {
+            while (c != '\n' && c != EOF)
+                c = reader_getc(reader);
+        }
+        if (c == EOF || !isspace(c))
+            break;
+    }
+    reader->token_length = 0;
+    if (c == EOF)
+        return TOK_EOF;
+    if (c == '(')
+        return TOK_OPEN;
+    if (c == ')')
+        return TOK_CLOSE;
+    if (c == '\'')
+        return TOK_QUOTE;
+    if (c == '"') {
+        // the token is the string's contents, escapes already replaced
+        while ((c = reader_getc(reader)) != '"') {
+            if (c == '\\') {
+                c = reader_getc(reader);
+                if (c == 'n')
+                    c = '\n';
+                else if (c == 't')
+                    c = '\t';
+            }
+            if (c == EOF) {
+                report_error("missing closing \"");
+                return TOK_EOF;
+            }
+            token_push(reader, c);
+        }
+        token_push(reader, '\0');
+        reader->token_length--;
+        return TOK_STRING;
+    }
+    token_push(reader, c);
+    while (!delim(reader_peek(reader)))
+        token_push(reader, reader_getc(reader));
+    return TOK_ATOM;
+}
+
+// An optional sign then only digits.
+char is_integer_token(char *tok)
+{
+    if (*tok == '-' || *tok == '+')
+        tok++;
+    if (!*tok)
+        return 0;
+    for (; *tok; tok++) {
+        if (!isdigit((unsigned char)*tok))
+            return 0;
+    }
+    return 1;
+}
+
+// Decimal notation strtod accepts in full, like 1.5, -.5 or 1e10, and the
+// infinities and NaN as print_flonum writes them. Other tokens not starting
+// with a digit, sign or point (inf, nan) stay symbols.
+char is_decimal_token(char *tok, double *value)
+{
+    if (strcmp(tok, "+inf.0") == 0 || strcmp(tok, "-inf.0") == 0) {
+        *value = (tok[0] == '-' ? -1 : 1) * HUGE_VAL;
+        return 1;
+    }
+    if (strcmp(tok, "+nan.0") == 0 || strcmp(tok, "-nan.0") == 0) {
+        *value = NAN;
+        return 1;
+    }
+    char *p = tok;
+    if (*p == '-' || *p == '+')
+        p++;
+    if (*p == '.')
+        p++;
+    if (!isdigit((unsigned char)*p))
+        return 0;
+    char *end;
+    *value = strtod(tok, &end);
+    return *end == '\0';
+}
+
+Object *read_atom(char *tok)
+{
+    char first_char = *tok;
+    double decimal;
+    if (is_integer_token(tok)) {
+        return parse_integer(tok);
+    }
+    else if (is_decimal_token(tok, &decimal)) {
+        return new_flonum(decimal);
+    }
+    else if (strcmp(tok, "#t") == 0) {
+        return true_obj;
+    }
+    else if (strcmp(tok, "#f") == 0) {
+        return false_obj;
+    }
+    else if (first_char == '#' && tok[1] == '\\' && tok[2]) {
+        if (strcmp(tok + 2, "space") == 0)
+            return new_char(' ');
+        if (strcmp(tok + 2, "newline") == 0)
+            return new_char('\n');
+        return new_char(tok[2]);
+    }
+    else  {
+        return intern(tok);
+    }
+}
+
+Object *list_to_vector_of(ObjectType type, Object *arg_list, char *name);
+
+// The type of vector a #( #s64( or #f64( token opens, or FREE.
+ObjectType vector_literal_type(Reader *reader)
+{
+    if (reader_peek(reader) != '(')
+        return FREE;
+    if (strcmp(reader->token, "#") == 0)
+        return VECTOR;
+    if (strcmp(reader->token, "#s64") == 0)
+        return S64VECTOR;
+    if (strcmp(reader->token, "#f64") == 0)
+        return F64VECTOR;
+    return FREE;
+}
+
+// Each list, vector literal or quote being read has a frame of four
+// eval_stack entries, which keep the partial list rooted: its head, its
+// last pair, what it reads into (PAIR, a vector type, or FREE for a quote)
+// and whether its dotted tail has been read.
+#define READ_FRAME 4
+
+static inline Object **read_frame(size_t depth)
+{
+    return eval_stack + eval_sp - READ_FRAME * (depth + 1);
+}
+
+// Returns the next datum, or eof_object once the input is used up. Nested
+// lists are read with frames on eval_stack rather than C recursion, so any
+// depth of nesting reads, as any depth prints.
+Object *read(Reader *reader)
+{
+    size_t bottom = eval_sp;
+    int open_lists = 0;
+    Token token = next_token(reader);
+    while (1) {
+        Object *datum;
+        ObjectType type = FREE;
+        if (token == TOK_EOF) {
+            if (open_lists > 0)
+                report_error("unexpected end of input in list.");
+            eval_sp = bottom;
+            return eof_object;
+        }
+        if (token == TOK_QUOTE || token == TOK_OPEN
+                || (token == TOK_ATOM && (type = vector_literal_type(reader)) != FREE)) {
+            if (token == TOK_ATOM)
+                next_token(reader); // the (
+            save(nill);
+            save(nill);
+            save(new_int(token == TOK_QUOTE ? FREE : token == TOK_OPEN ? PAIR : type));
+            save(false_obj);
+            open_lists += token != TOK_QUOTE;
+            token = next_token(reader);
+            continue;
+        }
+        if (token == TOK_CLOSE) {
+            if (eval_sp == bottom || fixnum_value(read_frame(0)[2]) == FREE) {
+                report_error("unexpected )");
+                token = next_token(reader);
+                continue;
+            }
+            datum = read_frame(0)[0];
+        }
+        else if (token == TOK_ATOM && strcmp(reader->token, ".") == 0 && eval_sp > bottom
+                 && fixnum_value(read_frame(0)[2]) != FREE && !is_nill(read_frame(0)[1])
+                 && read_frame(0)[3] == false_obj) {
+            read_frame(0)[3] = true_obj;
+            token = next_token(reader);
+            continue;
+        }
+        else if (token == TOK_STRING) {
+            datum = new_string(reader->token, reader->token_length);
+        }
+        else {
+            datum = read_atom(reader->token);
+        }
+
+        // hand datum to the innermost frame, finishing each that it completes
+        while (1) {
+            if (token == TOK_CLOSE) {
+                // datum is the finished list of the innermost frame
+                type = fixnum_value(read_frame(0)[2]);
+                eval_sp -= READ_FRAME;
+                open_lists--;
+                if (type != PAIR)
+                    datum = list_to_vector_of(type, datum, "read");
+                token = TOK_ATOM;
+            }
+            if (eval_sp == bottom)
+                return datum;
+            Object **frame = read_frame(0);
+            if (fixnum_value(frame[2]) == FREE) {
+                eval_sp -= READ_FRAME;
+                datum = cons(quote_sym, cons(datum, nill));
+                continue;
+            }
+            if (frame[3] == true_obj) {
+                set_cdr(frame[1], datum);
+                // a dotted tail ends its list, ) or not
+                if (next_token(reader) != TOK_CLOSE)
+                    report_error("expected ) after dotted tail.");
+                datum = read_frame(0)[0];
+                token = TOK_CLOSE;
+                continue;
+            }
+            datum = cons(datum, nill);
+            if (is_nill(frame[1]))
+                frame[0] = datum;
+            else
+                set_cdr(frame[1], datum);
+            frame[1] = datum;
+            break;
+        }
+        token = next_token(reader);
+    }
+}
+// ...................Interpreter Data Structures..............................
+// An environment is a chain of frames ending in the global environment.
+// A procedure call gets a FRAME: a parent pointer, the list of names it binds
+// and a contiguous vector of value slots, all in one allocation.
+// The global environment is a GLOBAL_ENV: an open-addressing hash table of
+// (name . value) binding pairs keyed by symbol address, kept at most half
+// full, so defining, setting and looking up a global are all O(1).
+typedef struct BindingTable {
+    Object **bindings;
+    size_t size;
+    size_t count;
+} BindingTable;
+
+Object *the_empty_environment;
+Object *the_global_environment;
+
+Object *new_global_environment(void)
+{
+    Object *new_obj = alloc_object(GLOBAL_ENV);
+    BindingTable *table = malloc(sizeof(BindingTable));
+    table->size = GLOBAL_TABLE_INITIAL_SIZE;
+    table->count = 0;
+    table->bindings = calloc(table->size, sizeof(Object*));
+    new_obj->value.table = table;
+    return new_obj;
+}
+
+// Slot holding name's binding, or the empty slot where it belongs.
+Object **table_slot(BindingTable *table, Object *name)
+{
+    size_t mask = table->size - 1;
+    size_t i = hash_pointer(name) & mask;
+    while (table->bindings[i] && car(table->bindings[i]) != name)
+        i = (i + 1) & mask;
+    return &table->bindings[i];
+}
+
+void grow_binding_table(BindingTable *table)
+{
+    Object **old_bindings = table->bindings;
+    size_t old_size = table->size;
+    table->size *= 2;
+    table->bindings = calloc(table->size, sizeof(Object*));
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_bindings[i])
+            *table_slot(table, car(old_bindings[i])) = old_bindings[i];
+    }
+    free(old_bindings);
+}
+
+Object *global_binding(Object *name)
+{
+    return *table_slot(the_global_environment->value.table, name);
+}
+
+Object *parent_env(Object *environment)
+{
+    if (has_type(environment, FRAME))
+        return environment->value.frame.parent;
+    return the_empty_environment;
+}
+
+Object *frame_value(Object *name, Object *value)
+{
+    if (value == unassigned) {
+        report_error("%s not defined.", name->value.symbol);
+        return nill;
+    }
+    return value;
+}
+
+Object* lookup_variable(Object *name, Object *environment)
+{
+    if (environment == the_empty_environment) {
+        report_error("%s not defined.", name->value.symbol);
+        return nill;
+    }
+    if (has_type(environment, FRAME)) {
+        int index = list_index(name, environment->value.frame.names);
+        if (index >= 0)
+            return frame_value(name, frame_slots(environment)[index]);
+        return lookup_variable(name, parent_env(environment));
+    }
+    Object *binding = global_binding(name);
+    if (binding)
+        return frame_value(name, cdr(binding));
+    return lookup_variable(name, parent_env(environment));
+}
+
+// Variables resolved by resolve() skip the name search entirely: a local is
+// found by hopping depth frames up and reading the slot at index.
+Object *lookup_lexical(Object *ref, Object *environment)
+{
+    for (int depth = ref->value.ref.depth; depth > 0; depth--)
+        environment = environment->value.frame.parent;
+    return frame_value(ref->value.ref.name, frame_slots(environment)[ref->value.ref.index]);
+}
+
+// Global references do not search the table either. A binding pair is
+// never replaced once it is in the table, define and set! update its cdr in
+// place, so every reference site holds on to its binding from the moment it
+// is resolved or compiled (see global_cell) and reading a global is a load.
+// A name referenced before it is defined gets a binding holding unassigned,
+// which binding_value reports.
+Object *lookup_global(Object *ref)
+{
+    return binding_value(ref->value.global_ref.binding);
+}
+
+void set_global(Object *binding, Object *value)
+{
+    if (cdr(binding) == unassigned)
+        report_error("%s not defined.", car(binding)->value.symbol);
+    else
+        set_cdr(binding, value);
+}
+
+void define_variable(Object *variable, Object *value, Object *environment) 
+{
+    if (has_type(environment, FRAME)) {
+        // resolve() gave every internal definition a slot up front
+        int index = list_index(variable, environment->value.frame.names);
+        if (index < 0) {
+            report_error("define of %s is not at the start of a body.", variable->value.symbol);
+            return;
+        }
+        frame_slots(environment)[index] = value;
+        return;
+    }
+    BindingTable *table = environment->value.table;
+    Object *binding = *table_slot(table, variable);
+    if (binding) {
+        set_cdr(binding, value);
+        return;
+    }
+    binding = cons(variable, value);
+    *table_slot(table, variable) = binding;
+    if (2 * ++table->count > table->size)
+        grow_binding_table(table);
+}
+
+void set_variable_value(Object *variable, Object *value, Object *environment)
+{
+    while (has_type(environment, FRAME)) {
+        int index = list_index(variable, environment->value.frame.names);
+        if (index >= 0) {
+            frame_slots(environment)[index] = value;
+            return;
+        }
+        environment = parent_env(environment);
+    }
+    Object *binding = global_binding(variable);
+    if (binding)
+        set_global(binding, value);
+    else
+        report_error("%s not defined.", variable->value.symbol);
+}
+
+// name's binding pair, added unassigned if name has none yet.
+Object *global_cell(Object *name)
+{
+    Object *binding = global_binding(name);
+    if (!binding) {
+        define_variable(name, unassigned, the_global_environment);
+        binding = global_binding(name);
+    }
+    return binding;
+}
+
+void set_lexical(Object *ref, Object *value, Object *environment)
+{
+    for (int depth = ref->value.ref.depth; depth > 0; depth--)
+        environment = environment->value.frame.parent;
+    frame_slots(environment)[ref->value.ref.index] = value;
+}
+
+// A compiled lambda body (or top-level expression). code holds opcodes
+// followed inline by their operands; constants holds quoted data, global
+// names and nested CODE objects. names and frame_size give the layout of
+// the FRAME each call gets; arity and name describe the procedure.
+typedef struct Bytecode {
+    int *code;
+    int length;
+    int capacity;
+    Object **constants;
+    int nconstants;
+    int constants_capacity;
+    Object *names;
+    int frame_size;
+    int arity;
+    Object *name;
+    char toplevel;
+} Bytecode;
+
+// In InlineIndex order.
+InlinePrimitive inline_primitives[NUM_INLINE_PRIMITIVES] = {
+    {"+", 2, "native_add", NULL}, {"-", 2, "native_sub", NULL}, {"<", 2, "native_lt", NULL},
+    {">", 2, "native_gt", NULL}, {"=", 2, "native_num_eq", NULL}, {"car", 1, "native_car", NULL},
+    {"cdr", 1, "native_cdr", NULL}, {"cons", 2, "native_cons", NULL},
+    {"eq?", 2, "native_eq", NULL}, {"null?", 1, "native_null", NULL},
+    {"pair?", 1, "native_pair", NULL}
+};
+
+// The evaluator's stack of saved registers, continuation labels and
+// pending arguments. It is a GC root; labels and counts are pushed as
+// fixnums, so marking skips them.
+Object **eval_stack;
+size_t eval_sp;
+size_t eval_stack_capacity;
+
+// Counters for (runtime-stats) and --stats. Each mode counts an eval step
+// per expression, node or instruction it runs, and an application per
+// procedure it calls.
+size_t eval_steps;
+size_t applications;
+
+// Arguments of the call an analyzed node in tail position left on
+// eval_stack before returning tail_call.
+int tail_call_argc;
+
+// ...............................Collector....................................
+// Precise mark and sweep. Roots are the global environment, the symbol
+// table, the interpreter's static objects and every PROTECTed C local.
+size_t gc_collections;
+double gc_total_pause;
+double gc_max_pause;
+
+// The objects of the heap image loaded at startup, if any, see Heap images.
+// They are never swept, only unmarked.
+Object **image_objects;
+size_t image_object_count;
+// The tables and ports rebuilt for them. Only the file mapping refers to
+// these otherwise, which leak checkers do not look through.
+void **image_tables;
+size_t image_table_count;
+
+Object **gc_mark_stack;
+size_t gc_mark_count;
+size_t gc_mark_capacity;
+
+void gc_push_mark(Object *obj)
+{
+    if (obj == NULL || !is_heap_object(obj) || obj->marked)
+        return;
+    if (gc_mark_count == gc_mark_capacity) {
+        gc_mark_capacity = gc_mark_capacity ? 2 * gc_mark_capacity : 1024;
+        gc_mark_stack = realloc(gc_mark_stack, gc_mark_capacity * sizeof(Object*));
+        if (!gc_mark_stack)
+            out_of_memory();
+    }
+    gc_mark_stack[gc_mark_count++] = obj;
+}
+
+void gc_mark(Object *root)
+{
+    gc_push_mark(root);
+    while (gc_mark_count > 0) {
+        Object *obj = gc_mark_stack[--gc_mark_count];
+        if (obj->marked)
+            continue;
+        obj->marked = 1;
+        if (obj->type == PAIR) {
+            gc_push_mark(obj->value.pair.cdr);
+            gc_push_mark(obj->value.pair.car);
+        }
+        else if (obj->type == LOCAL_REF) {
+            gc_push_mark(obj->value.ref.name);
+        }
+        else if (obj->type == GLOBAL_REF) {
+            gc_push_mark(obj->value.global_ref.name);
+            gc_push_mark(obj->value.global_ref.binding);
+        }
+        else if (obj->type == FRAME) {
+            gc_push_mark(obj->value.frame.parent);
+            gc_push_mark(obj->value.frame.names);
+            Object **slots = frame_slots(obj);
+            for (Object *n = obj->value.frame.names; is_pair(n); n = cdr(n))
+                gc_push_mark(*slots++);
+        }
+        else if (obj->type == GLOBAL_ENV) {
+            BindingTable *table = obj->value.table;
+            for (size_t i = 0; i < table->size; i++)
+                gc_push_mark(table->bindings[i]);
+        }
+        else if (obj->type == CODE) {
+            Bytecode *bc = obj->value.bytecode;
+            gc_push_mark(bc->names);
+            gc_push_mark(bc->name);
+            for (int i = 0; i < bc->nconstants; i++)
+                gc_push_mark(bc->constants[i]);
+        }
+        else if (obj->type == CLOSURE) {
+            gc_push_mark(obj->value.closure.env);
+            gc_push_mark(obj->value.closure.lambda);
+        }
+        else if (obj->type == NATIVE) {
+            gc_push_mark(obj->value.native.name);
+        }
+        else if (obj->type == NODE) {
+            Object **parts = node_parts(obj);
+            for (int i = 0; i < obj->value.node.count; i++)
+                gc_push_mark(parts[i]);
+        }
+        else if (obj->type == VECTOR) {
+            Object **elements = vector_elements(obj);
+            for (size_t i = 0; i < obj->value.vector.length; i++)
+                gc_push_mark(elements[i]);
+        }
+        else if (obj->type == STRING) {
+            if (string_base(obj) != obj)
+                gc_push_mark(string_base(obj));
+        }
+        else if (obj->type == HASHTABLE) {
+            HashTable *table = obj->value.hash_table;
+            for (size_t i = 0; i < table->size; i++) {
+                gc_push_mark(table->entries[i].key);
+                gc_push_mark(table->entries[i].value);
+            }
+        }
+    }
+}
+
+void free_output_port(struct OutputPort *port);
+
+void free_object_storage(Object *obj)
+{
+    if (obj->type == SYMBOL)
+        free(obj->value.symbol);
+    else if (obj->type == BIGNUM)
+        free(obj->value.bignum.digits);
+    else if (obj->type == GLOBAL_ENV) {
+        free(obj->value.table->bindings);
+        free(obj->value.table);
+    }
+    else if (obj->type == HASHTABLE) {
+        free(obj->value.hash_table->entries);
+        free(obj->value.hash_table);
+    }
+    else if (obj->type == PORT)
+        free_output_port(obj->value.port);
+    else if (obj->type == CODE) {
+        free(obj->value.bytecode->code);
+        free(obj->value.bytecode->constants);
+        free(obj->value.bytecode);
+    }
+}
+
+#ifndef MALLOC_OBJECTS
+// Rebuilds the free lists from scratch, coalescing each run of adjacent dead
+// or already free cells.
+void sweep_slabs(void)
+{
+    retire_bump_run();
+    for (size_t n = 0; n <= MAX_SLAB_CELLS; n++)
+        free_lists[n] = NULL;
+    for (Slab *slab = slabs; slab; slab = slab->next) {
+        Object *run = NULL;
+        size_t run_cells = 0;
+        for (size_t i = 0; i < SLAB_OBJECTS;) {
+            Object *obj = &slab->objects[i];
+            size_t cells = obj->cells;
+            i += cells;
+            if (obj->marked) {
+                obj->marked = 0;
+                if (run)
+                    release_cells(run, run_cells);
+                run = NULL;
+                continue;
+            }
+            if (obj->type != FREE) {
+                free_object_storage(obj);
+                gc_live_cells -= cells;
+            }
+            if (!run) {
+                run = obj;
+                run_cells = 0;
+            }
+            run_cells += cells;
+        }
+        if (run)
+            release_cells(run, run_cells);
+    }
+}
+#endif
+
+void sweep_large_objects(void)
+{
+    LargeObject **link = &large_objects;
+    while (*link) {
+        LargeObject *large = *link;
+        if (large->object->marked) {
+            large->object->marked = 0;
+            link = &large->next;
+        }
+        else {
+            *link = large->next;
+            free_object_storage(large->object);
+            gc_live_cells -= large->cells;
+            free(large);
+        }
+    }
+}
+
+void gc_sweep(void)
+{
+#ifndef MALLOC_OBJECTS
+    sweep_slabs();
+#endif
+    sweep_large_objects();
+    for (size_t i = 0; i < image_object_count; i++)
+        image_objects[i]->marked = 0;
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void gc_collect(void)
+{
+    double start = now_seconds();
+    for (size_t i = 0; i < NUM_INLINE_PRIMITIVES; i++)
+        gc_mark(inline_primitives[i].builtin);
+    gc_mark(the_global_environment);
+    gc_mark(command_line_arguments);
+    for (size_t i = 0; i < symbol_table_size; i++)
+        gc_mark(symbol_table[i]);
+    for (size_t i = 0; i < gc_root_count; i++)
+        gc_mark(*gc_roots[i]);
+    for (size_t i = 0; i < eval_sp; i++)
+        gc_mark(eval_stack[i]);
+    gc_sweep();
+    // Keep the heap at most half full so we don't collect on every allocation.
+    if (2 * gc_live_cells > gc_heap_size)
+        gc_heap_size = 2 * gc_live_cells;
+    double pause = now_seconds() - start;
+    ++gc_collections;
+    gc_total_pause += pause;
+    if (pause > gc_max_pause)
+        gc_max_pause = pause;
+}
+
+void gc_report(void)
+{
+    fprintf(stderr, "GC: %zu collections, %.3f ms total pause, %.3f ms max pause, "
+            "%zu live cells, heap size %zu cells\n",
+            gc_collections, gc_total_pause * 1e3, gc_max_pause * 1e3,
+            gc_live_cells, gc_heap_size);
+}
+
+// ...............................Profiler.....................................
+// Turned on by --profile, or for the duration of a top-level (profile expr).
+// Every mode brackets each call of a closure with profile_enter and
+// profile_exit, which keep a shadow stack of the running procedures; a tail
+// call exits its caller before entering the callee, so the shadow stack is
+// no deeper than the real one. Procedures are identified by the name they
+// were defined under, anonymous ones share a record.
+// Calls are also counted along a tree of call paths, with direct recursion
+// folded into a single node, which is written out in the collapsed-stack
+// format of flamegraph.pl, weighted by self time in microseconds.
+char profiling;
+char *profile_stacks_path;
+
+typedef struct ProfileRecord {
+    Object *name;
+    long calls;
+    int active; // frames on the shadow stack, so recursion is timed once
+    double total_time;
+    double self_time;
+    size_t allocations; // by the procedure itself, not its callees
+} ProfileRecord;
+
+typedef struct ProfileNode {
+    Object *name;
+    int record;
+    int parent;
+    int first_child;
+    int next_sibling;
+    double self_time;
+} ProfileNode;
+
+typedef struct ProfileFrame {
+    int node;
+    double start;
+    double child_time;
+    size_t start_allocations;
+    size_t child_allocations;
+} ProfileFrame;
+
+ProfileRecord *profile_records;
+int profile_record_count;
+int profile_record_capacity;
+ProfileNode *profile_nodes; // node 0 is the root of the call tree
+int profile_node_count;
+int profile_node_capacity;
+ProfileFrame *profile_stack;
+int profile_depth;
+int profile_stack_capacity;
+
+int profile_record(Object *name)
+{
+    for (int i = 0; i < profile_record_count; i++) {
+        if (profile_records[i].name == name)
+            return i;
+    }
+    if (profile_record_count == profile_record_capacity) {
+        profile_record_capacity = profile_record_capacity ? 2 * profile_record_capacity : 64;
+        profile_records = realloc(profile_records,
+                profile_record_capacity * sizeof(ProfileRecord));
+    }
+    ProfileRecord *record = &profile_records[profile_record_count];
+    memset(record, 0, sizeof(ProfileRecord));
+    record->name = name;
+    return profile_record_count++;
+}
+
+int new_profile_node(Object *name, int parent)
+{
+    if (profile_node_count == profile_node_capacity) {
+        profile_node_capacity = profile_node_capacity ? 2 * profile_node_capacity : 256;
+        profile_nodes = realloc(profile_nodes, profile_node_capacity * sizeof(ProfileNode));
+    }
+    ProfileNode *node = &profile_nodes[profile_node_count];
+    node->name = name;
+    node->record = parent < 0 ? -1 : profile_record(name);
+    node->parent = parent;
+    node->first_child = -1;
+    node->next_sibling = -1;
+    node->self_time = 0;
+    if (parent >= 0) {
+        node->next_sibling = profile_nodes[parent].first_child;
+        profile_nodes[parent].first_child = profile_node_count;
+    }
+    return profile_node_count++;
+}
+
+// The child of parent for name, created on first use.
+int profile_child(int parent, Object *name)
+{
+    if (profile_node_count == 0)
+        new_profile_node(nill, -1);
+    for (int i = profile_nodes[parent].first_child; i >= 0; i = profile_nodes[i].next_sibling) {
+        if (profile_nodes[i].name == name)
+            return i;
+    }
+    return new_profile_node(name, parent);
+}
+
+// name is the procedure's name, () if it is anonymous.
+void profile_enter(Object *name)
+{
+    int parent = profile_depth ? profile_stack[profile_depth - 1].node : 0;
+    int node = parent;
+    if (parent == 0 || profile_nodes[parent].name != name)
+        node = profile_child(parent, name);
+    ProfileRecord *record = &profile_records[profile_nodes[node].record];
+    record->calls++;
+    record->active++;
+    if (profile_depth == profile_stack_capacity) {
+        profile_stack_capacity = profile_stack_capacity ? 2 * profile_stack_capacity : 256;
+        profile_stack = realloc(profile_stack, profile_stack_capacity * sizeof(ProfileFrame));
+    }
+    ProfileFrame *frame = &profile_stack[profile_depth++];
+    frame->node = node;
+    frame->child_time = 0;
+    frame->child_allocations = 0;
+    frame->start_allocations = gc_allocated_objects;
+    frame->start = now_seconds();
+}
+
+void profile_exit(void)
+{
+    double now = now_seconds();
+    if (profile_depth == 0)
+        return;
+    ProfileFrame *frame = &profile_stack[--profile_depth];
+    ProfileNode *node = &profile_nodes[frame->node];
+    ProfileRecord *record = &profile_records[node->record];
+    double elapsed = now - frame->start;
+    size_t allocated = gc_allocated_objects - frame->start_allocations;
+    node->self_time += elapsed - frame->child_time;
+    record->self_time += elapsed - frame->child_time;
+    record->allocations += allocated - frame->child_allocations;
+    if (--record->active == 0)
+        record->total_time += elapsed;
+    if (profile_depth > 0) {
+        profile_stack[profile_depth - 1].child_time += elapsed;
+        profile_stack[profile_depth - 1].child_allocations += allocated;
+    }
+}
+
+char *profile_name(Object *name)
+{
+    return is_symbol(name) ? name->value.symbol : "#<procedure>";
+}
+
+int compare_self_time(const void *a, const void *b)
+{
+    double x = ((ProfileRecord*)a)->self_time;
+    double y = ((ProfileRecord*)b)->self_time;
+    return (x < y) - (x > y);
+}
+
+void write_profile_stacks(FILE *out)
+{
+    int *path = NULL;
+    int path_capacity = 0;
+    for (int i = 1; i < profile_node_count; i++) {
+        long micros = (long)(profile_nodes[i].self_time * 1e6);
+        if (micros <= 0)
+            continue;
+        int length = 0;
+        for (int n = i; n > 0; n = profile_nodes[n].parent) {
+            if (length == path_capacity) {
+                path_capacity = path_capacity ? 2 * path_capacity : 64;
+                path = realloc(path, path_capacity * sizeof(int));
+            }
+            path[length++] = n;
+        }
+        while (length-- > 0)
+            fprintf(out, "%s%c", profile_name(profile_nodes[path[length]].name),
+                    length ? ';' : ' ');
+        fprintf(out, "%ld\n", micros);
+    }
+    free(path);
+}
+
+// Prints the report sorted by self time to stderr, writes the collapsed
+// stacks if --profile-stacks asked for them and starts over. The first report
+// of the run truncates the stacks file and later ones append to it, so every
+// top-level (profile expr) ends up there.
+void profile_finish(void)
+{
+    static char stacks_written;
+    flush_stdout_port();
+    qsort(profile_records, profile_record_count, sizeof(ProfileRecord), compare_self_time);
+    fprintf(stderr, "%10s %12s %12s %12s  %s\n",
+            "calls", "total ms", "self ms", "allocs", "procedure");
+    for (int i = 0; i < profile_record_count; i++) {
+        ProfileRecord *record = &profile_records[i];
+        fprintf(stderr, "%10ld %12.3f %12.3f %12zu  %s\n", record->calls,
+                record->total_time * 1e3, record->self_time * 1e3, record->allocations,
+                profile_name(record->name));
+    }
+    if (profile_stacks_path) {
+        FILE *out = fopen(profile_stacks_path, stacks_written ? "a" : "w");
+        if (out) {
+            stacks_written = 1;
+            write_profile_stacks(out);
+            fclose(out);
+        }
+        else {
+            fprintf(stderr, "cannot write %s\n", profile_stacks_path);
+        }
+    }
+    // nodes refer to records by index, so both go
+    profile_record_count = 0;
+    profile_node_count = 0;
+    profile_depth = 0;
+}
+
+double start_time;
+
+void runtime_report(void)
+{
+    flush_stdout_port();
+    fprintf(stderr, "Stats: %.3f ms, %zu eval steps, %zu applications, %zu allocations, "
+            "%zu peak environment depth, %zu collections\n",
+            (now_seconds() - start_time) * 1e3, eval_steps, applications,
+            gc_allocated_objects, environment_depth_peak, gc_collections);
+}
+
+// ..............................Builtins......................................
+// A primitive gets its argc arguments as argv, which points into eval_stack
+// (see call_primitive), so the arguments are GC roots for the whole call.
+// argv is only valid until the primitive pushes onto eval_stack itself.
+
+// Folds op over the arguments, starting from the first or from identity
+// when there are fewer than min_args.
+Object *fold_numbers(int argc, Object **argv, Object* (*op)(Object*, Object*),
+        Object *identity, int min_args, char *name)
+{
+    for (int i = 0; i < argc; i++) {
+        if (!is_number(argv[i])) {
+            report_error("%s applied to non-number.", name);
+            return nill;
+        }
+    }
+    Object *acc = identity;
+    int i = 0;
+    if (argc >= min_args)
+        acc = argv[i++];
+    PROTECT(acc);
+    // an op that reports an error gives ()
+    for (; i < argc && is_number(acc); i++)
+        acc = op(acc, argv[i]);
+    UNPROTECT(1);
+    return acc;
+}
+
+Object *add(int argc, Object **argv)
+{
+    Object *result;
+    // (+ a b) on fixnums is by far the most common call
+    if (argc == 2 && is_fixnum(argv[0]) && is_fixnum(argv[1])
+            && fixnum_add(argv[0], argv[1], &result))
+        return result;
+    return fold_numbers(argc, argv, number_add, new_int(0), 1, "+");
+}
+
+Object *mul(int argc, Object **argv)
+{
+    return fold_numbers(argc, argv, number_mul, new_int(1), 1, "*");
+}
+
+Object *sub(int argc, Object **argv)
+{
+    Object *result;
+    if (argc == 2 && is_fixnum(argv[0]) && is_fixnum(argv[1])
+            && fixnum_sub(argv[0], argv[1], &result))
+        return result;
+    // (- x) negates
+    return fold_numbers(argc, argv, number_sub, new_int(0), 2, "-");
+}
+
+Object *divide(int argc, Object **argv)
+{
+    // (/ x) is the reciprocal
+    return fold_numbers(argc, argv, number_div, new_int(1), 2, "/");
+}
+
+// ..........Vectors of objects, s64 and f64. The three kinds share one set
+// of helpers; each primitive passes the type and name it was called as.
+
+// obj if it is a vector of type, else NULL after reporting an error.
+Object *vector_argument(Object *obj, ObjectType type, char *name)
+{
+    if (!has_type(obj, type)) {
+        report_error("%s applied to the wrong kind of vector.", name);
+        return NULL;
+    }
+    return obj;
+}
+
+// Whether k is a fixnum with 0 <= k < bound.
+char valid_index(Object *k, size_t bound, char *name)
+{
+    if (!is_fixnum(k) || fixnum_value(k) < 0 || (size_t)fixnum_value(k) >= bound) {
+        report_error("%s: index out of range.", name);
+        return 0;
+    }
+    return 1;
+}
+
+// Element i as an object; boxes an f64 and may allocate.
+Object *vector_element(Object *vector, size_t i)
+{
+    if (vector->type == S64VECTOR)
+        return integer_from_int64(s64vector_elements(vector)[i]);
+    if (vector->type == F64VECTOR)
+        return new_flonum(f64vector_elements(vector)[i]);
+    return vector_elements(vector)[i];
+}
+
+char set_vector_element(Object *vector, size_t i, Object *value, char *name)
+{
+    if (vector->type == S64VECTOR) {
+        if (!integer_to_int64(value, &s64vector_elements(vector)[i])) {
+            report_error("%s: s64vector element must be an integer in int64 range.", name);
+            return 0;
+        }
+    }
+    else if (vector->type == F64VECTOR) {
+        if (!is_number(value)) {
+            report_error("%s: f64vector element must be a number.", name);
+            return 0;
+        }
+        f64vector_elements(vector)[i] = number_to_double(value);
+    }
+    else
+        vector_elements(vector)[i] = value;
+    return 1;
+}
+
+// vector-fill! on any kind; f64 and s64 fills are plain loops over raw
+// memory that the compiler vectorizes.
+char fill_vector(Object *vector, Object *fill, char *name)
+{
+    size_t n = vector_length(vector);
+    if (vector->type == S64VECTOR) {
+        int64_t x;
+        if (!integer_to_int64(fill, &x)) {
+            report_error("%s: s64vector element must be an integer in int64 range.", name);
+            return 0;
+        }
+        int64_t *elements = s64vector_elements(vector);
+        for (size_t i = 0; i < n; i++)
+            elements[i] = x;
+    }
+    else if (vector->type == F64VECTOR) {
+        if (!is_number(fill)) {
+            report_error("%s: f64vector element must be a number.", name);
+            return 0;
+        }
+        double x = number_to_double(fill);
+        double *elements = f64vector_elements(vector);
+        for (size_t i = 0; i < n; i++)
+            elements[i] = x;
+    }
+    else {
+        Object **elements = vector_elements(vector);
+        for (size_t i = 0; i < n; i++)
+            elements[i] = fill;
+    }
+    return 1;
+}
+
+// (make-<kind> n [fill])
+Object *make_vector_of(ObjectType type, int argc, Object **argv, char *name)
+{
+    Object *n = argv[0];
+    Object *fill = argc > 1 ? argv[1] : type == VECTOR ? nill : new_int(0);
+    if (!is_fixnum(n) || fixnum_value(n) < 0) {
+        report_error("%s: length must be a non-negative fixnum.", name);
+        return nill;
+    }
+    if (fixnum_value(n) > MAX_VECTOR_LENGTH) {
+        report_error("%s: length too large.", name);
+        return nill;
+    }
+    PROTECT(fill);
+    Object *vector = new_vector(type, fixnum_value(n));
+    UNPROTECT(1);
+    if (!vector) {
+        report_error("%s: out of memory.", name);
+        return nill;
+    }
+    if (!fill_vector(vector, fill, name))
+        return nill;
+    return vector;
+}
+
+// (<kind> x ...)
+Object *vector_of(ObjectType type, int argc, Object **argv, char *name)
+{
+    Object *vector = new_vector(type, argc);
+    if (!vector) {
+        report_error("%s: out of memory.", name);
+        return nill;
+    }
+    for (int i = 0; i < argc; i++) {
+        if (!set_vector_element(vector, i, argv[i], name))
+            return nill;
+    }
+    return vector;
+}
+
+// A vector of type holding the elements of list.
+Object *list_to_vector_of(ObjectType type, Object *arg_list, char *name)
+{
+    PROTECT(arg_list);
+    Object *vector = new_vector(type, list_length(arg_list));
+    UNPROTECT(1);
+    if (!vector) {
+        report_error("%s: out of memory.", name);
+        return nill;
+    }
+    for (size_t i = 0; is_pair(arg_list); i++, arg_list = cdr(arg_list)) {
+        if (!set_vector_element(vector, i, car(arg_list), name))
+            return nill;
+    }
+    return vector;
+}
+
+Object *vector_length_of(ObjectType type, Object **argv, char *name)
+{
+    Object *vector = vector_argument(argv[0], type, name);
+    return vector ? new_int(vector_length(vector)) : nill;
+}
+
+Object *vector_ref_of(ObjectType type, Object **argv, char *name)
+{
+    Object *vector = vector_argument(argv[0], type, name);
+    if (!vector || !valid_index(argv[1], vector_length(vector), name))
+        return nill;
+    return vector_element(vector, fixnum_value(argv[1]));
+}
+
+Object *vector_set_of(ObjectType type, Object **argv, char *name)
+{
+    Object *vector = vector_argument(argv[0], type, name);
+    if (vector && valid_index(argv[1], vector_length(vector), name))
+        set_vector_element(vector, fixnum_value(argv[1]), argv[2], name);
+    return nill;
+}
+
+Object *make_vector(int argc, Object **argv)
+{
+    return make_vector_of(VECTOR, argc, argv, "make-vector");
+}
+
+Object *make_s64vector(int argc, Object **argv)
+{
+    return make_vector_of(S64VECTOR, argc, argv, "make-s64vector");
+}
+
+Object *make_f64vector(int argc, Object **argv)
+{
+    return make_vector_of(F64VECTOR, argc, argv, "make-f64vector");
+}
+
+Object *vector(int argc, Object **argv)
+{
+    return vector_of(VECTOR, argc, argv, "vector");
+}
+
+Object *s64vector(int argc, Object **argv)
+{
+    return vector_of(S64VECTOR, argc, argv, "s64vector");
+}
+
+Object *f64vector(int argc, Object **argv)
+{
+    return vector_of(F64VECTOR, argc, argv, "f64vector");
+}
+
+Object *vector_length_procedure(int argc, Object **argv)
+{
+    return vector_length_of(VECTOR, argv, "vector-length");
+}
+
+Object *s64vector_length(int argc, Object **argv)
+{
+    return vector_length_of(S64VECTOR, argv, "s64vector-length");
+}
+
+Object *f64vector_length(int argc, Object **argv)
+{
+    return vector_length_of(F64VECTOR, argv, "f64vector-length");
+}
+
+Object *vector_ref(int argc, Object **argv)
+{
+    return vector_ref_of(VECTOR, argv, "vector-ref");
+}
+
+Object *s64vector_ref(int argc, Object **argv)
+{
+    return vector_ref_of(S64VECTOR, argv, "s64vector-ref");
+}
+
+Object *f64vector_ref(int argc, Object **argv)
+{
+    return vector_ref_of(F64VECTOR, argv, "f64vector-ref");
+}
+
+Object *vector_set(int argc, Object **argv)
+{
+    return vector_set_of(VECTOR, argv, "vector-set!");
+}
+
+Object *s64vector_set(int argc, Object **argv)
+{
+    return vector_set_of(S64VECTOR, argv, "s64vector-set!");
+}
+
+Object *f64vector_set(int argc, Object **argv)
+{
+    return vector_set_of(F64VECTOR, argv, "f64vector-set!");
+}
+
+
+Object *vector_fill(int argc, Object **argv)
+{
+    if (!is_any_vector(argv[0])) {
+        report_error("vector-fill! applied to non-vector.");
+        return nill;
+    }
+    fill_vector(argv[0], argv[1], "vector-fill!");
+    return nill;
+}
+
+// (vector-copy! to at from [start [end]]) for two vectors of the same kind.
+// Overlapping ranges of one vector are fine.
+Object *vector_copy(int argc, Object **argv)
+{
+    Object *to = argv[0];
+    Object *at = argv[1];
+    Object *from = argv[2];
+    if (!is_any_vector(to) || !has_type(from, to->type)) {
+        report_error("vector-copy! needs two vectors of the same kind.");
+        return nill;
+    }
+    Object *start = argc > 3 ? argv[3] : new_int(0);
+    Object *end = argc > 4 ? argv[4] : new_int(vector_length(from));
+    if (!valid_index(end, vector_length(from) + 1, "vector-copy!")
+            || !valid_index(start, fixnum_value(end) + 1, "vector-copy!")
+            || !valid_index(at, vector_length(to) + 1, "vector-copy!"))
+        return nill;
+    size_t count = fixnum_value(end) - fixnum_value(start);
+    if (fixnum_value(at) + count > vector_length(to)) {
+        report_error("vector-copy!: destination too short.");
+        return nill;
+    }
+    // every kind stores 8-byte elements after the header
+    memmove(vector_elements(to) + fixnum_value(at), vector_elements(from) + fixnum_value(start),
+            count * sizeof(Object*));
+    return nill;
+}
+
+Object *call_procedure(int argc);
+
+// (vector-map proc v) gives a new vector of v's kind.
+Object *vector_map(int argc, Object **argv)
+{
+    Object *proc = argv[0];
+    Object *from = argv[1];
+    if (!is_any_vector(from)) {
+        report_error("vector-map applied to non-vector.");
+        return nill;
+    }
+    Object *to = nill;
+    Object *value = nill;
+    PROTECT(proc);
+    PROTECT(from);
+    PROTECT(to);
+    PROTECT(value);
+    size_t n = vector_length(from);
+    to = new_vector(from->type, n);
+    if (!to) {
+        report_error("vector-map: out of memory.");
+        UNPROTECT(4);
+        return nill;
+    }
+    for (size_t i = 0; i < n; i++) {
+        value = vector_element(from, i);
+        save(proc);
+        save(value);
+        value = call_procedure(1);
+        if (!set_vector_element(to, i, value, "vector-map"))
+            break;
+    }
+    UNPROTECT(4);
+    return to;
+}
+
+Object *vector_to_list(int argc, Object **argv)
+{
+    Object *vector = argv[0];
+    if (!is_any_vector(vector)) {
+        report_error("vector->list applied to non-vector.");
+        return nill;
+    }
+    Object *result = nill;
+    PROTECT(vector);
+    PROTECT(result);
+    for (size_t i = vector_length(vector); i-- > 0;)
+        result = cons(vector_element(vector, i), result);
+    UNPROTECT(2);
+    return result;
+}
+
+Object *list_to_vector(int argc, Object **argv)
+{
+    return list_to_vector_of(VECTOR, argv[0], "list->vector");
+}
+
+Object *f64vector_sum(int argc, Object **argv)
+{
+    Object *vector = vector_argument(argv[0], F64VECTOR, "f64vector-sum");
+    if (!vector)
+        return nill;
+    return new_flonum(f64_sum(f64vector_elements(vector), vector_length(vector)));
+}
+
+Object *f64vector_dot(int argc, Object **argv)
+{
+    Object *x = vector_argument(argv[0], F64VECTOR, "f64vector-dot");
+    Object *y = vector_argument(argv[1], F64VECTOR, "f64vector-dot");
+    if (!x || !y)
+        return nill;
+    if (vector_length(x) != vector_length(y)) {
+        report_error("f64vector-dot of vectors of different lengths.");
+        return nill;
+    }
+    return new_flonum(f64_dot(f64vector_elements(x), f64vector_elements(y), vector_length(x)));
+}
+
+// ..........Hash tables
+HashTable *hash_table_argument(Object *obj, char *name)
+{
+    if (!has_type(obj, HASHTABLE)) {
+        report_error("%s applied to non-hash-table.", name);
+        return NULL;
+    }
+    return obj->value.hash_table;
+}
+
+Object *make_hash_table(int argc, Object **argv)
+{
+    return new_hash_table();
+}
+
+Object *is_hash_table(int argc, Object **argv)
+{
+    return new_boolean(has_type(argv[0], HASHTABLE));
+}
+
+// (hash-table-ref table key [default]) is an error for a missing key unless
+// a default is given.
+Object *hash_table_ref(int argc, Object **argv)
+{
+    HashTable *table = hash_table_argument(argv[0], "hash-table-ref");
+    if (!table)
+        return nill;
+    HashEntry *entry = hash_table_entry(table, argv[1], hash_key(argv[1]));
+    if (entry->key)
+        return entry->value;
+    if (argc > 2)
+        return argv[2];
+    report_error("hash-table-ref: key not found.");
+    return nill;
+}
+
+Object *hash_table_set(int argc, Object **argv)
+{
+    HashTable *table = hash_table_argument(argv[0], "hash-table-set!");
+    if (table)
+        hash_table_put(table, argv[1], argv[2]);
+    return nill;
+}
+
+// (hash-table-update! table key proc [default]) stores (proc value), with
+// value the default when key is missing.
+Object *hash_table_update(int argc, Object **argv)
+{
+    Object *table_obj = argv[0];
+    Object *key = argv[1];
+    Object *proc = argv[2];
+    HashTable *table = hash_table_argument(table_obj, "hash-table-update!");
+    if (!table)
+        return nill;
+    HashEntry *entry = hash_table_entry(table, key, hash_key(key));
+    Object *value;
+    if (entry->key)
+        value = entry->value;
+    else if (argc > 3)
+        value = argv[3];
+    else {
+        report_error("hash-table-update!: key not found.");
+        return nill;
+    }
+    PROTECT(table_obj);
+    PROTECT(key);
+    save(proc);
+    save(value);
+    value = call_procedure(1);
+    // proc may have changed the table, so the entry is looked up again
+    hash_table_put(table, key, value);
+    UNPROTECT(2);
+    return nill;
+}
+
+Object *hash_table_delete(int argc, Object **argv)
+{
+    HashTable *table = hash_table_argument(argv[0], "hash-table-delete!");
+    if (table)
+        hash_table_remove(table, argv[1]);
+    return nill;
+}
+
+Object *hash_table_contains(int argc, Object **argv)
+{
+    HashTable *table = hash_table_argument(argv[0], "hash-table-contains?");
+    if (!table)
+        return nill;
+    return new_boolean(hash_table_entry(table, argv[1], hash_key(argv[1]))->key != NULL);
+}
+
+Object *hash_table_count(int argc, Object **argv)
+{
+    HashTable *table = hash_table_argument(argv[0], "hash-table-count");
+    return table ? new_int(table->count) : nill;
+}
+
+typedef enum HashTablePart {KEYS, VALUES, ENTRIES} HashTablePart;
+
+// A fresh list of the keys, values or (key . value) pairs, in no
+// particular order.
+Object *hash_table_list(Object *table_obj, HashTablePart part, char *name)
+{
+    HashTable *table = hash_table_argument(table_obj, name);
+    if (!table)
+        return nill;
+    Object *result = nill;
+    Object *item = nill;
+    PROTECT(table_obj);
+    PROTECT(result);
+    PROTECT(item);
+    for (size_t i = table->size; i-- > 0;) {
+        HashEntry *entry = &table->entries[i];
+        if (!entry->key)
+            continue;
+        item = part == KEYS ? entry->key : part == VALUES ? entry->value
+                                                          : cons(entry->key, entry->value);
+        result = cons(item, result);
+    }
+    UNPROTECT(3);
+    return result;
+}
+
+Object *hash_table_keys(int argc, Object **argv)
+{
+    return hash_table_list(argv[0], KEYS, "hash-table-keys");
+}
+
+Object *hash_table_values(int argc, Object **argv)
+{
+    return hash_table_list(argv[0], VALUES, "hash-table-values");
+}
+
+Object *hash_table_to_alist(int argc, Object **argv)
+{
+    return hash_table_list(argv[0], ENTRIES, "hash-table->alist");
+}
+
+// (hash-table-walk table proc) calls (proc key value) for every entry present
+// when the walk starts, so proc may change the table.
+Object *hash_table_walk(int argc, Object **argv)
+{
+    Object *proc = argv[1];
+    Object *entries = hash_table_list(argv[0], ENTRIES, "hash-table-walk");
+    PROTECT(proc);
+    PROTECT(entries);
+    for (Object *e = entries; is_pair(e); e = cdr(e)) {
+        save(proc);
+        save(car(car(e)));
+        save(cdr(car(e)));
+        call_procedure(2);
+    }
+    UNPROTECT(2);
+    return nill;
+}
+
+// ..........Strings and string ports
+// A string port is an OutputPort with no file wrapped in a PORT object, so
+// text can be built up with amortized O(1) appends and taken out as one
+// string at the end. Ports themselves are covered under PRINT.
+typedef struct OutputPort {
+    FILE *file;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+} OutputPort;
+
+OutputPort *new_output_port(FILE *file);
+void port_write(OutputPort *port, const char *s, size_t n);
+void print_object(OutputPort *port, Object *expr, char write);
+extern OutputPort *stdout_port;
+
+Object *string_argument(Object *obj, char *name)
+{
+    if (!is_string(obj)) {
+        report_error("%s applied to non-string.", name);
+        return NULL;
+    }
+    return obj;
+}
+
+// The port argument at index, or standard output when it is not given.
+OutputPort *port_argument(int argc, Object **argv, int index, char *name)
+{
+    if (argc <= index)
+        return stdout_port;
+    if (!has_type(argv[index], PORT)) {
+        report_error("%s applied to non-port.", name);
+        return NULL;
+    }
+    return argv[index]->value.port;
+}
+
+Object *is_string_procedure(int argc, Object **argv)
+{
+    return new_boolean(is_string(argv[0]));
+}
+
+Object *string_length(int argc, Object **argv)
+{
+    Object *string = string_argument(argv[0], "string-length");
+    return string ? new_int(string->value.string.length) : nill;
+}
+
+Object *string_ref(int argc, Object **argv)
+{
+    Object *string = string_argument(argv[0], "string-ref");
+    if (!string || !valid_index(argv[1], string->value.string.length, "string-ref"))
+        return nill;
+    return new_char(string->value.string.chars[fixnum_value(argv[1])]);
+}
+
+Object *string_eq(int argc, Object **argv)
+{
+    Object *a = string_argument(argv[0], "string=?");
+    Object *b = string_argument(argv[1], "string=?");
+    if (!a || !b)
+        return nill;
+    return new_boolean(string_equal(a, b));
+}
+
+Object *string_lt(int argc, Object **argv)
+{
+    Object *a = string_argument(argv[0], "string<?");
+    Object *b = string_argument(argv[1], "string<?");
+    if (!a || !b)
+        return nill;
+    uint32_t la = a->value.string.length;
+    uint32_t lb = b->value.string.length;
+    int c = memcmp(a->value.string.chars, b->value.string.chars, la < lb ? la : lb);
+    return new_boolean(c < 0 || (c == 0 && la < lb));
+}
+
+// (string-prefix? prefix s)
+Object *string_prefix(int argc, Object **argv)
+{
+    Object *prefix = string_argument(argv[0], "string-prefix?");
+    Object *string = string_argument(argv[1], "string-prefix?");
+    if (!prefix || !string)
+        return nill;
+    uint32_t n = prefix->value.string.length;
+    return new_boolean(n <= string->value.string.length
+                       && memcmp(prefix->value.string.chars, string->value.string.chars, n) == 0);
+}
+
+// (substring s start [end]) shares s's bytes when it is long enough.
+Object *substring(int argc, Object **argv)
+{
+    Object *string = string_argument(argv[0], "substring");
+    if (!string)
+        return nill;
+    size_t length = string->value.string.length;
+    Object *end = argc > 2 ? argv[2] : new_int(length);
+    if (!valid_index(end, length + 1, "substring") || !valid_index(argv[1], length + 1, "substring"))
+        return nill;
+    if (fixnum_value(argv[1]) > fixnum_value(end)) {
+        report_error("substring: start is after end.");
+        return nill;
+    }
+    return new_substring(string, fixnum_value(argv[1]), fixnum_value(end) - fixnum_value(argv[1]));
+}
+
+// Sizes the result first, so it is allocated and copied into once.
+Object *string_append(int argc, Object **argv)
+{
+    size_t length = 0;
+    for (int i = 0; i < argc; i++) {
+        if (!string_argument(argv[i], "string-append"))
+            return nill;
+        length += argv[i]->value.string.length;
+    }
+    if (length > UINT32_MAX) {
+        report_error("string-append: result too long.");
+        return nill;
+    }
+    Object *result = alloc_string(length);
+    if (!result) {
+        report_error("string-append: out of memory.");
+        return nill;
+    }
+    char *p = result->value.string.chars;
+    for (int i = 0; i < argc; i++) {
+        memcpy(p, argv[i]->value.string.chars, argv[i]->value.string.length);
+        p += argv[i]->value.string.length;
+    }
+    return result;
+}
+
+Object *string_to_list(int argc, Object **argv)
+{
+    Object *string = string_argument(argv[0], "string->list");
+    if (!string)
+        return nill;
+    Object *result = nill;
+    PROTECT(string);
+    PROTECT(result);
+    for (size_t i = string->value.string.length; i-- > 0;)
+        result = cons(new_char(string->value.string.chars[i]), result);
+    UNPROTECT(2);
+    return result;
+}
+
+Object *list_to_string(int argc, Object **argv)
+{
+    Object *list = argv[0];
+    for (Object *l = list; is_pair(l); l = cdr(l)) {
+        if (!is_char(car(l))) {
+            report_error("list->string: element is not a character.");
+            return nill;
+        }
+    }
+    PROTECT(list);
+    Object *result = alloc_string(list_length(list));
+    UNPROTECT(1);
+    if (!result) {
+        report_error("list->string: out of memory.");
+        return nill;
+    }
+    for (char *p = result->value.string.chars; is_pair(list); list = cdr(list))
+        *p++ = char_value(car(list));
+    return result;
+}
+
+Object *string_to_symbol(int argc, Object **argv)
+{
+    Object *string = string_argument(argv[0], "string->symbol");
+    if (!string)
+        return nill;
+    char *name = malloc(string->value.string.length + 1);
+    memcpy(name, string->value.string.chars, string->value.string.length);
+    name[string->value.string.length] = '\0';
+    Object *symbol = intern(name);
+    free(name);
+    return symbol;
+}
+
+Object *symbol_to_string(int argc, Object **argv)
+{
+    if (!is_symbol(argv[0])) {
+        report_error("symbol->string applied to non-symbol.");
+        return nill;
+    }
+    return new_string(argv[0]->value.symbol, strlen(argv[0]->value.symbol));
+}
+
+Object *number_to_string(int argc, Object **argv)
+{
+    if (!is_number(argv[0])) {
+        report_error("number->string applied to non-number.");
+        return nill;
+    }
+    OutputPort *port = new_output_port(NULL);
+    print_object(port, argv[0], 0);
+    Object *string = new_string(port->buffer, port->length);
+    free_output_port(port);
+    return string;
+}
+
+Object *open_output_string(int argc, Object **argv)
+{
+    Object *port = alloc_object(PORT);
+    port->value.port = new_output_port(NULL);
+    return port;
+}
+
+// The text written so far, copied, so the port can go on growing.
+Object *get_output_string(int argc, Object **argv)
+{
+    if (!has_type(argv[0], PORT) || argv[0]->value.port->file) {
+        report_error("get-output-string applied to non-string-port.");
+        return nill;
+    }
+    OutputPort *port = argv[0]->value.port;
+    Object *string = port->length > UINT32_MAX ? NULL : alloc_string(port->length);
+    if (!string) {
+        report_error("get-output-string: string too long.");
+        return nill;
+    }
+    memcpy(string->value.string.chars, port->buffer, port->length);
+    return string;
+}
+
+Object *write_string(int argc, Object **argv)
+{
+    Object *string = string_argument(argv[0], "write-string");
+    OutputPort *port = port_argument(argc, argv, 1, "write-string");
+    if (string && port)
+        port_write(port, string->value.string.chars, string->value.string.length);
+    return nill;
+}
+
+Object *write_char(int argc, Object **argv)
+{
+    OutputPort *port = port_argument(argc, argv, 1, "write-char");
+    if (!is_char(argv[0])) {
+        report_error("write-char applied to non-character.");
+        return nill;
+    }
+    if (port) {
+        char c = char_value(argv[0]);
+        port_write(port, &c, 1);
+    }
+    return nill;
+}
+
+Object *cons_procedure(int argc, Object **argv)
+{
+    return cons(argv[0], argv[1]);
+}
+
+Object *car_procedure(int argc, Object **argv)
+{
+    if (!is_pair(argv[0])) {
+        report_error("car applied to non-pair.");
+        return nill;
+    }
+    return car(argv[0]);
+}
+
+Object *cdr_procedure(int argc, Object **argv)
+{
+    if (!is_pair(argv[0])) {
+        report_error("cdr applied to non-pair.");
+        return nill;
+    }
+    return cdr(argv[0]);
+}
+
+Object *display_procedure(int argc, Object **argv)
+{
+    OutputPort *port = port_argument(argc, argv, 1, "display");
+    if (port)
+        print_object(port, argv[0], 0);
+    return nill;
+}
+
+Object *write_procedure(int argc, Object **argv)
+{
+    OutputPort *port = port_argument(argc, argv, 1, "write");
+    if (port)
+        print_object(port, argv[0], 1);
+    return nill;
+}
+
+Object *newline_procedure(int argc, Object **argv)
+{
+    OutputPort *port = port_argument(argc, argv, 0, "newline");
+    if (port)
+        port_write(port, "\n", 1);
+    return nill;
+}
+
+Object *command_line(int argc, Object **argv)
+{
+    return command_line_arguments;
+}
+
+Object *is_pair_procedure(int argc, Object **argv)
+{
+    return new_boolean(is_pair(argv[0]));
+}
+
+Object *is_null_procedure(int argc, Object **argv)
+{
+    return new_boolean(is_nill(argv[0]));
+}
+
+// (runtime-stats): the counters since startup as an association list.
+Object *runtime_stats(int argc, Object **argv)
+{
+    struct {
+        char *name;
+        size_t value;
+    } stats[] = {
+        {"allocations", gc_allocated_objects},
+        {"eval-steps", eval_steps},
+        {"applications", applications},
+        {"peak-environment-depth", environment_depth_peak},
+        {"collections", gc_collections},
+    };
+    Object *result = nill;
+    PROTECT(result);
+    for (int i = sizeof(stats) / sizeof(stats[0]) - 1; i >= 0; i--) {
+        Object *entry = cons(intern(stats[i].name), integer_from_int64(stats[i].value));
+        result = cons(entry, result);
+    }
+    UNPROTECT(1);
+    return result;
+}
+
+Object *dump_image(int argc, Object **argv);
+
+// Argument counts are checked by check_application before a primitive runs,
+// so primitives only check their argument types.
+const Primitive builtins[] = {
+    {"+", add, 0, -1},
+    {"*", mul, 0, -1},
+    {"-", sub, 1, -1},
+    {"/", divide, 1, -1},
+    {"=", numerical_eq, 2, 2},
+    {">", numerical_gt, 2, 2},
+    {"<", numerical_lt, 2, 2},
+    {"eq?", is_eq_procedure, 2, 2},
+    {"eqv?", is_eqv_procedure, 2, 2},
+    {"equal?", is_equal_procedure, 2, 2},
+    {"cons", cons_procedure, 2, 2},
+    {"car", car_procedure, 1, 1},
+    {"cdr", cdr_procedure, 1, 1},
+    {"display", display_procedure, 1, 2},
+    {"write", write_procedure, 1, 2},
+    {"newline", newline_procedure, 0, 1},
+    {"command-line", command_line, 0, 0},
+    {"pair?", is_pair_procedure, 1, 1},
+    {"null?", is_null_procedure, 1, 1},
+    {"runtime-stats", runtime_stats, 0, 0},
+    {"make-vector", make_vector, 1, 2},
+    {"vector", vector, 0, -1},
+    {"vector-length", vector_length_procedure, 1, 1},
+    {"vector-ref", vector_ref, 2, 2},
+    {"vector-set!", vector_set, 3, 3},
+    {"vector-fill!", vector_fill, 2, 2},
+    {"vector-copy!", vector_copy, 3, 5},
+    {"vector-map", vector_map, 2, 2},
+    {"vector->list", vector_to_list, 1, 1},
+    {"list->vector", list_to_vector, 1, 1},
+    {"make-s64vector", make_s64vector, 1, 2},
+    {"s64vector", s64vector, 0, -1},
+    {"s64vector-length", s64vector_length, 1, 1},
+    {"s64vector-ref", s64vector_ref, 2, 2},
+    {"s64vector-set!", s64vector_set, 3, 3},
+    {"make-f64vector", make_f64vector, 1, 2},
+    {"f64vector", f64vector, 0, -1},
+    {"f64vector-length", f64vector_length, 1, 1},
+    {"f64vector-ref", f64vector_ref, 2, 2},
+    {"f64vector-set!", f64vector_set, 3, 3},
+    {"f64vector-sum", f64vector_sum, 1, 1},
+    {"f64vector-dot", f64vector_dot, 2, 2},
+    {"make-hash-table", make_hash_table, 0, 0},
+    {"hash-table?", is_hash_table, 1, 1},
+    {"hash-table-ref", hash_table_ref, 2, 3},
+    {"hash-table-set!", hash_table_set, 3, 3},
+    {"hash-table-update!", hash_table_update, 3, 4},
+    {"hash-table-delete!", hash_table_delete, 2, 2},
+    {"hash-table-contains?", hash_table_contains, 2, 2},
+    {"hash-table-count", hash_table_count, 1, 1},
+    {"hash-table-keys", hash_table_keys, 1, 1},
+    {"hash-table-values", hash_table_values, 1, 1},
+    {"hash-table->alist", hash_table_to_alist, 1, 1},
+    {"hash-table-walk", hash_table_walk, 2, 2},
+    {"string?", is_string_procedure, 1, 1},
+    {"string-length", string_length, 1, 1},
+    {"string-ref", string_ref, 2, 2},
+    {"string=?", string_eq, 2, 2},
+    {"string<?", string_lt, 2, 2},
+    {"string-prefix?", string_prefix, 2, 2},
+    {"substring", substring, 2, 3},
+    {"string-append", string_append, 0, -1},
+    {"string->list", string_to_list, 1, 1},
+    {"list->string", list_to_string, 1, 1},
+    {"string->symbol", string_to_symbol, 1, 1},
+    {"symbol->string", symbol_to_string, 1, 1},
+    {"number->string", number_to_string, 1, 1},
+    {"open-output-string", open_output_string, 0, 0},
+    {"get-output-string", get_output_string, 1, 1},
+    {"write-string", write_string, 1, 2},
+    {"write-char", write_char, 1, 2},
+    {"dump-image", dump_image, 1, 1},
+};
+
+void define_primitive(const Primitive *primitive, Object *env)
+{
+    Object *proc = new_primitive(primitive);
+    PROTECT(proc);
+    define_variable(intern(primitive->name), proc, env);
+    UNPROTECT(1);
+}
+
+Object *load_builtins(void)
+{
+    Object *env = new_global_environment();
+    PROTECT(env);
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+        define_primitive(&builtins[i], env);
+    UNPROTECT(1);
+    return env;
+}
+
+// .......................Syntax manipulation..................................
+char is_lambda(Object *expr) 
+{
+    return is_tagged_list(lambda_sym, expr);
+}
+
+Object *lambda_params(Object *lambda_definition)
+{
+    return cadr(lambda_definition);
+}
+
+Object *lambda_body(Object *lambda_definition)
+{
+    return cddr(lambda_definition);
+}
+
+Object *make_lambda(Object *lambda_params, Object *lambda_body)
+{
+    return cons(lambda_sym, cons(lambda_params, lambda_body));
+}
+
+char is_definition(Object *expr) 
+{
+    return is_tagged_list(define_sym, expr);
+}
+
+Object *definition_variable(Object *expr)
+{
+    if (is_symbol(cadr(expr))) {
+        return cadr(expr);
+    }
+    else {
+        return caadr(expr);
+    }
+}
+
+Object *definition_value(Object *expr)
+{
+    if (is_symbol(cadr(expr))) {
+        return caddr(expr);
+    }
+    else {
+        return make_lambda(cdadr(expr), cddr(expr));
+    }
+}
+
+char is_assignment(Object *expr)
+{
+    return is_tagged_list(set_sym, expr);
+}
+
+Object *assignment_variable(Object *expr)
+{
+    return cadr(expr);
+}
+
+Object *assignment_value(Object *expr)
+{
+    return caddr(expr);
+}
+
+char is_self_evaluating(Object *expr) 
+{
+    // every immediate (number, char, boolean, ()) evaluates to itself
+    return !is_heap_object(expr) || is_string(expr) || is_bignum(expr) || is_flonum(expr)
+        || is_any_vector(expr);
+}
+
+char is_application(Object *expr) 
+{
+    return is_pair(expr);
+}
+
+char is_last_exp(Object *expr_seq) 
+{
+    return is_pair(expr_seq) && is_nill(cdr(expr_seq));
+}
+
+char is_if(Object *expr)
+{
+    return is_tagged_list(if_sym, expr);
+}
+
+Object *if_test(Object *expr) 
+{
+    return cadr(expr);
+}
+
+Object *if_consequent(Object *expr) 
+{
+    return caddr(expr);
+}
+
+Object *if_subsequent(Object *expr) 
+{
+    if (!is_nill(cdr(cddr(expr))))
+        return cadddr(expr);
+    else
+        return false_obj;
+}
+
+char is_quoted(Object *expr)
+{
+    return is_tagged_list(quote_sym, expr);
+}
+
+Object *quotation_text(Object *expr)
+{
+    return cadr(expr);
+}
+
+// ...........................Lexical addressing...............................
+// A pre-pass over each top-level expression that rewrites variable
+// references inside lambda bodies into LOCAL_REFs holding the (frame depth,
+// binding index) of the variable, and every other reference into a
+// GLOBAL_REF, so eval never has to compare names at runtime.
+// A scope is a list of frames, innermost first; a frame lists the lambda's
+// parameters followed by the names defined at the top of its body. The
+// resolved lambda takes that whole list as its frame, so a call's FRAME has
+// a slot for every internal definition from the start and the arguments fill
+// the leading slots. Since the frame no longer tells how many of its names
+// are parameters, the resolved lambda records the arity next to it, along
+// with the name it was defined under for diagnostics:
+//   (lambda frame-vars arity name . body)
+Object *resolve(Object *expr, Object *scope);
+
+Object *resolved_lambda_frame(Object *expr)
+{
+    return cadr(expr);
+}
+
+int resolved_lambda_arity(Object *expr)
+{
+    return fixnum_value(caddr(expr));
+}
+
+Object *resolved_lambda_name(Object *expr)
+{
+    return cadddr(expr);
+}
+
+Object *resolved_lambda_body(Object *expr)
+{
+    return cdr(cdddr(expr));
+}
+
+// The number of parameters, or -(required + 1) when a rest parameter, as in
+// (lambda (a . rest) ...) or (lambda args ...), takes the remaining arguments.
+int params_arity(Object *params)
+{
+    int required = 0;
+    for (; is_pair(params); params = cdr(params))
+        required++;
+    return is_nill(params) ? required : -required - 1;
+}
+
+Object *frame_variables(Object *params, Object *body)
+{
+    PROTECT(params);
+    PROTECT(body);
+    Object *vars = nill;
+    PROTECT(vars);
+    Object *p = params;
+    for (; is_pair(p); p = cdr(p))
+        vars = cons(car(p), vars);
+    if (is_symbol(p))
+        vars = cons(p, vars);
+    for (Object *b = body; is_pair(b); b = cdr(b)) {
+        if (is_definition(car(b)) && list_index(definition_variable(car(b)), vars) < 0)
+            vars = cons(definition_variable(car(b)), vars);
+    }
+    Object *result = reverse(vars);
+    UNPROTECT(3);
+    return result;
+}
+
+Object *resolve_variable(Object *name, Object *scope)
+{
+    for (int depth = 0; !is_nill(scope); depth++, scope = cdr(scope)) {
+        int index = list_index(name, car(scope));
+        if (index >= 0)
+            return new_local_ref(name, depth, index);
+    }
+    return new_global_ref(name, global_cell(name));
+}
+
+Object *resolve_list(Object *exprs, Object *scope)
+{
+    if (is_nill(exprs))
+        return nill;
+    PROTECT(exprs);
+    PROTECT(scope);
+    Object *head = resolve(car(exprs), scope);
+    PROTECT(head);
+    Object *tail = resolve_list(cdr(exprs), scope);
+    UNPROTECT(3);
+    return cons(head, tail);
+}
+
+// name is the variable a define binds the lambda to, () if anonymous.
+Object *resolve_lambda(Object *expr, Object *scope, Object *name)
+{
+    PROTECT(expr);
+    PROTECT(scope);
+    PROTECT(name);
+    Object *frame = frame_variables(lambda_params(expr), lambda_body(expr));
+    Object *inner_scope = cons(frame, scope);
+    PROTECT(inner_scope);
+    Object *body = resolve_list(lambda_body(expr), inner_scope);
+    Object *arity = new_int(params_arity(lambda_params(expr)));
+    Object *result = cons(lambda_sym, cons(frame, cons(arity, cons(name, body))));
+    UNPROTECT(4);
+    return result;
+}
+
+Object *resolve(Object *expr, Object *scope)
+{
+    if (is_symbol(expr))
+        return resolve_variable(expr, scope);
+    if (is_atom(expr) || is_quoted(expr))
+        return expr;
+    PROTECT(expr);
+    PROTECT(scope);
+    Object *result;
+    if (is_lambda(expr)) {
+        result = resolve_lambda(expr, scope, nill);
+    }
+    else if (is_definition(expr)) {
+        Object *value = definition_value(expr);
+        if (is_lambda(value))
+            value = resolve_lambda(value, scope, definition_variable(expr));
+        else
+            value = resolve(value, scope);
+        result = cons(define_sym, cons(definition_variable(expr), cons(value, nill)));
+    }
+    else if (is_if(expr) || is_assignment(expr)) {
+        result = cons(car(expr), resolve_list(cdr(expr), scope));
+    }
+    else {
+        result = resolve_list(expr, scope);
+    }
+    UNPROTECT(2);
+    return result;
+}
+
+// ....................................EVAL....................................
+Object *vm_apply(int argc);
+Object *call_analyzed(int argc);
+
+int closure_arity(Object *closure)
+{
+    Object *lambda = closure_lambda(closure);
+    if (has_type(lambda, CODE))
+        return lambda->value.bytecode->arity;
+    if (has_type(lambda, NODE))
+        return fixnum_value(node_parts(lambda)[3]);
+    if (has_type(lambda, NATIVE))
+        return lambda->value.native.lambda->arity;
+    return resolved_lambda_arity(lambda);
+}
+
+Object *closure_name(Object *closure)
+{
+    Object *lambda = closure_lambda(closure);
+    if (has_type(lambda, CODE))
+        return lambda->value.bytecode->name;
+    if (has_type(lambda, NODE))
+        return node_parts(lambda)[4];
+    if (has_type(lambda, NATIVE))
+        return lambda->value.native.name;
+    return resolved_lambda_name(lambda);
+}
+
+// The name to show for a procedure in messages, NULL if it is anonymous.
+char *procedure_name(Object *proc)
+{
+    if (is_primitive_procedure(proc))
+        return proc->value.primitive->name;
+    Object *name = closure_name(proc);
+    return is_symbol(name) ? name->value.symbol : NULL;
+}
+
+// Every mode calls this before applying proc to argc arguments. It reports
+// calling something that is not a procedure, or calling a procedure with
+// the wrong number of arguments, in which case the call evaluates to ().
+char check_application(Object *proc, int argc)
+{
+    int min_args, max_args;
+    if (is_primitive_procedure(proc)) {
+        min_args = proc->value.primitive->min_args;
+        max_args = proc->value.primitive->max_args;
+    }
+    else if (has_type(proc, CLOSURE)) {
+        int arity = closure_arity(proc);
+        min_args = arity < 0 ? -arity - 1 : arity;
+        max_args = arity < 0 ? -1 : arity;
+    }
+    else {
+        report_error("First element is not a procedure.");
+        return 0;
+    }
+    if (argc >= min_args && (max_args < 0 || argc <= max_args))
+        return 1;
+    char *name = procedure_name(proc);
+    if (name == NULL)
+        name = "#<procedure>";
+    char *plural = (max_args < 0 ? min_args : max_args) == 1 ? "" : "s";
+    if (max_args < 0)
+        report_error("%s: expected at least %d argument%s, got %d.", name, min_args, plural, argc);
+    else if (min_args < max_args)
+        report_error("%s: expected %d to %d argument%s, got %d.", name, min_args, max_args,
+                plural, argc);
+    else
+        report_error("%s: expected %d argument%s, got %d.", name, min_args, plural, argc);
+    return 0;
+}
+
+// A call pushes the procedure and then its arguments on eval_stack, and
+// whatever runs the procedure pops them all. Primitives read their
+// arguments in place, and closures copy them straight into the new frame,
+// so a call only allocates that frame.
+static inline Object *call_primitive(Object *proc, int argc)
+{
+    Object *val = proc->value.primitive->function(argc, eval_stack + eval_sp - argc);
+    eval_sp -= argc + 1;
+    return val;
+}
+
+// The FRAME for a call to a closure whose template has the given layout
+// and arity, filled from the argc arguments on eval_stack, which are popped
+// along with the closure. A rest parameter gets the arguments past the
+// required ones as a fresh list; that is the only time a call conses.
+static inline Object *bind_arguments(Object *names, int frame_size, int arity, int argc,
+        Object *parent)
+{
+    Object *rest = nill;
+    int required = arity;
+    if (arity < 0) {
+        required = -arity - 1;
+        for (int i = argc - 1; i >= required; i--)
+            rest = cons(eval_stack[eval_sp - argc + i], rest);
+    }
+    PROTECT(rest);
+    Object *frame = new_frame(names, frame_size, parent);
+    UNPROTECT(1);
+    Object **slots = frame_slots(frame);
+    Object **args = eval_stack + eval_sp - argc;
+    for (int i = 0; i < required; i++)
+        slots[i] = args[i];
+    if (arity < 0)
+        slots[required] = rest;
+    eval_sp -= argc + 1;
+    return frame;
+}
+
+// bind_arguments for the eval representation of a closure.
+Object *bind_closure_arguments(Object *proc, int argc)
+{
+    Object *frame = resolved_lambda_frame(closure_lambda(proc));
+    return bind_arguments(frame, list_length(frame), resolved_lambda_arity(closure_lambda(proc)),
+            argc, closure_environment(proc));
+}
+
+// An explicit-control evaluator in the style of SICP 5.4. eval runs as a
+// single loop over a handful of registers; anything that has to survive the
+// evaluation of a subexpression is saved on eval_stack together with the
+// continuation label to resume at, so the C stack never grows with the
+// Scheme program. Procedure bodies, if branches and the last expression of
+// a sequence are evaluated without saving anything, which makes tail calls
+// run in constant space.
+typedef enum Continuation {
+    EV_RETURN,
+    EV_IF_DECIDE,
+    EV_DEFINITION_ASSIGN,
+    EV_ASSIGNMENT_ASSIGN,
+    EV_APPL_DID_OPERATOR,
+    EV_APPL_ACCUMULATE_ARG,
+    EV_SEQUENCE_CONTINUE,
+    EV_PROFILE_RETURN
+} Continuation;
+
+// Enters proc's profile frame before eval runs its body, and makes the body
+// return through EV_PROFILE_RETURN to exit it. A call that would itself
+// return to EV_PROFILE_RETURN is a tail call and replaces its caller's frame.
+Continuation profile_call(Object *proc, Continuation cont)
+{
+    if (cont == EV_PROFILE_RETURN)
+        profile_exit();
+    else
+        save(new_int(cont));
+    profile_enter(closure_name(proc));
+    return EV_PROFILE_RETURN;
+}
+
+Object *eval(Object *expr, Object *env) 
+{
+    Object *val = nill;
+    Object *proc = nill;
+    Object *unev = nill;
+    Continuation cont = EV_RETURN;
+    int argc = 0;
+    PROTECT(expr);
+    PROTECT(env);
+    PROTECT(val);
+    PROTECT(proc);
+    PROTECT(unev);
+
+eval_dispatch:
+    eval_steps++;
+    if (is_self_evaluating(expr)) {
+        val = expr;
+        goto continue_dispatch;
+    }
+    if (is_local_ref(expr)) {
+        val = lookup_lexical(expr, env);
+        goto continue_dispatch;
+    }
+    else if (is_global_ref(expr)) {
+        val = lookup_global(expr);
+        goto continue_dispatch;
+    }
+    else if (is_quoted(expr)) {
+        val = quotation_text(expr);
+        goto continue_dispatch;
+    }
+    else if (is_symbol(expr)) {
+        val = lookup_variable(expr, env);
+        goto continue_dispatch;
+    }
+    else if (is_if(expr)) {
+        save(expr);
+        save(env);
+        save(new_int(cont));
+        cont = EV_IF_DECIDE;
+        expr = if_test(expr);
+        goto eval_dispatch;
+    }
+    else if (is_lambda(expr)) {
+        val = new_closure(expr, env);
+        goto continue_dispatch;
+    }
+    else if (is_definition(expr) || is_assignment(expr)) {
+        save(expr);
+        save(env);
+        save(new_int(cont));
+        if (is_definition(expr)) {
+            cont = EV_DEFINITION_ASSIGN;
+            expr = definition_value(expr);
+        }
+        else {
+            cont = EV_ASSIGNMENT_ASSIGN;
+            expr = assignment_value(expr);
+        }
+        goto eval_dispatch;
+    }
+    else if (is_application(expr)) {
+        // leaves the operator and then each argument on the stack
+        save(new_int(cont));
+        save(env);
+        save(cdr(expr));
+        cont = EV_APPL_DID_OPERATOR;
+        expr = car(expr);
+        goto eval_dispatch;
+    }
+    else {
+        report_error("I don't know how to evaluate this expr.");
+        val = nill;
+        goto continue_dispatch;
+    }
+
+appl_operand_loop:
+    if (is_nill(unev))
+        goto appl_apply;
+    save(env);
+    save(unev);
+    save(new_int(argc));
+    cont = EV_APPL_ACCUMULATE_ARG;
+    expr = car(unev);
+    goto eval_dispatch;
+
+appl_apply:
+    proc = eval_stack[eval_sp - argc - 1];
+    if (!check_application(proc, argc)) {
+        eval_sp -= argc + 1;
+        val = nill;
+    }
+    else if (is_primitive_procedure(proc)) {
+        applications++;
+        val = call_primitive(proc, argc);
+    }
+    else if (is_compound_procedure(proc)) {
+        applications++;
+        unev = resolved_lambda_body(closure_lambda(proc));
+        env = bind_closure_arguments(proc, argc);
+        cont = fixnum_value(restore());
+        if (profiling)
+            cont = profile_call(proc, cont);
+        goto eval_sequence;
+    }
+    else {
+        val = call_procedure(argc);
+    }
+    cont = fixnum_value(restore());
+    goto continue_dispatch;
+
+eval_sequence:
+    expr = car(unev);
+    if (is_last_exp(unev))
+        goto eval_dispatch;
+    save(new_int(cont));
+    save(env);
+    save(unev);
+    cont = EV_SEQUENCE_CONTINUE;
+    goto eval_dispatch;
+
+continue_dispatch:
+    switch (cont) {
+        case EV_RETURN:
+            UNPROTECT(5);
+            return val;
+        case EV_IF_DECIDE:
+            cont = fixnum_value(restore());
+            env = restore();
+            expr = restore();
+            expr = (val != false_obj) ? if_consequent(expr) : if_subsequent(expr);
+            goto eval_dispatch;
+        case EV_DEFINITION_ASSIGN:
+            cont = fixnum_value(restore());
+            env = restore();
+            expr = restore();
+            define_variable(definition_variable(expr), val, env);
+            val = nill;
+            goto continue_dispatch;
+        case EV_ASSIGNMENT_ASSIGN:
+            cont = fixnum_value(restore());
+            env = restore();
+            expr = restore();
+            unev = assignment_variable(expr);
+            if (is_local_ref(unev))
+                set_lexical(unev, val, env);
+            else if (is_global_ref(unev))
+                set_global(unev->value.global_ref.binding, val);
+            else
+                set_variable_value(unev, val, env);
+            val = nill;
+            goto continue_dispatch;
+        case EV_APPL_DID_OPERATOR:
+            unev = restore();
+            env = restore();
+            save(val);
+            argc = 0;
+            goto appl_operand_loop;
+        case EV_APPL_ACCUMULATE_ARG:
+            argc = fixnum_value(restore());
+            unev = restore();
+            env = restore();
+            save(val);
+            argc++;
+            unev = cdr(unev);
+            goto appl_operand_loop;
+        case EV_SEQUENCE_CONTINUE:
+            unev = restore();
+            env = restore();
+            cont = fixnum_value(restore());
+            unev = cdr(unev);
+            goto eval_sequence;
+        case EV_PROFILE_RETURN:
+            profile_exit();
+            cont = fixnum_value(restore());
+            goto continue_dispatch;
+    }
+    return val;
+}
+
+extern char *analyze_stack_base;
+extern size_t analyze_stack_limit;
+
+// Applies the procedure under argc arguments on eval_stack from C, e.g. for
+// a primitive that takes a procedure, and pops them all. A procedure that
+// calls back into such a primitive nests on the C stack in every mode, so
+// the depth is checked as in call_analyzed.
+Object *call_procedure(int argc)
+{
+    char here;
+    if ((size_t)(analyze_stack_base - &here) > analyze_stack_limit) {
+        report_error("Recursion too deep.");
+        eval_sp -= argc + 1;
+        return nill;
+    }
+    Object *proc = eval_stack[eval_sp - argc - 1];
+    if (is_native_procedure(proc))
+        return call_native(argc); // which checks and counts each call it makes
+    applications++;
+    if (!check_application(proc, argc)) {
+        eval_sp -= argc + 1;
+        return nill;
+    }
+    if (is_primitive_procedure(proc))
+        return call_primitive(proc, argc);
+    if (is_compiled_procedure(proc))
+        return vm_apply(argc);
+    if (is_analyzed_procedure(proc))
+        return call_analyzed(argc);
+    Object *body = resolved_lambda_body(closure_lambda(proc));
+    PROTECT(body);
+    if (profiling)
+        profile_enter(closure_name(proc));
+    Object *env = bind_closure_arguments(proc, argc);
+    PROTECT(env);
+    while (!is_last_exp(body)) {
+        eval(car(body), env);
+        body = cdr(body);
+    }
+    Object *val = eval(car(body), env);
+    if (profiling)
+        profile_exit();
+    UNPROTECT(2);
+    return val;
+}
+
+// ...............................Analyzer.....................................
+// An alternative to eval selected with --analyze, after SICP 4.1.7. Each
+// resolved expression is walked once and turned into a tree of NODE objects,
+// each holding the C function that executes it and its already extracted
+// parts, so running it does no syntax dispatch. A lambda body is analyzed
+// once when the lambda is, not on every application.
+//
+// Executors recurse on the C stack for subexpressions. A call in tail
+// position does not: it leaves the procedure and arguments on eval_stack
+// and returns tail_call, and call_analyzed loops on it, so tail calls run
+// in constant space. Other
+// calls nest on the C stack, which is checked against its rlimit so deep
+// recursion reports an error instead of crashing.
+Object *analyze(Object *expr, char tail);
+
+char *analyze_stack_base;
+size_t analyze_stack_limit;
+
+static inline Object *execute(Object *node, Object *env)
+{
+    eval_steps++;
+    return node->value.node.execute(node, env);
+}
+
+Object *execute_constant(Object *node, Object *env)
+{
+    return node_parts(node)[0];
+}
+
+Object *execute_local_ref(Object *node, Object *env)
+{
+    return lookup_lexical(node_parts(node)[0], env);
+}
+
+// The part is the binding itself.
+Object *execute_global_ref(Object *node, Object *env)
+{
+    return binding_value(node_parts(node)[0]);
+}
+
+Object *execute_variable(Object *node, Object *env)
+{
+    return lookup_variable(node_parts(node)[0], env);
+}
+
+Object *execute_if(Object *node, Object *env)
+{
+    Object **parts = node_parts(node);
+    if (execute(parts[0], env) != false_obj)
+        return execute(parts[1], env);
+    return execute(parts[2], env);
+}
+
+Object *execute_lambda(Object *node, Object *env)
+{
+    return new_closure(node, env);
+}
+
+Object *execute_definition(Object *node, Object *env)
+{
+    Object **parts = node_parts(node);
+    define_variable(parts[0], execute(parts[1], env), env);
+    return nill;
+}
+
+Object *execute_assignment(Object *node, Object *env)
+{
+    Object **parts = node_parts(node);
+    Object *val = execute(parts[1], env);
+    if (is_local_ref(parts[0]))
+        set_lexical(parts[0], val, env);
+    else if (is_global_ref(parts[0]))
+        set_global(parts[0]->value.global_ref.binding, val);
+    else
+        set_variable_value(parts[0], val, env);
+    return nill;
+}
+
+Object *execute_sequence(Object *node, Object *env)
+{
+    Object **parts = node_parts(node);
+    int last = node->value.node.count - 1;
+    for (int i = 0; i < last; i++)
+        execute(parts[i], env);
+    return execute(parts[last], env);
+}
+
+// Parts are the operator followed by the operands. Their values are left on
+// eval_stack, where a call to an analyzed procedure copies the arguments
+// straight into its new frame.
+int execute_operands(Object *node, Object *env)
+{
+    Object **parts = node_parts(node);
+    int count = node->value.node.count;
+    for (int i = 0; i < count; i++)
+        save(execute(parts[i], env));
+    return count - 1;
+}
+
+Object *call_analyzed(int argc);
+
+Object *execute_application(Object *node, Object *env)
+{
+    return call_analyzed(execute_operands(node, env));
+}
+
+Object *execute_tail_application(Object *node, Object *env)
+{
+    tail_call_argc = execute_operands(node, env);
+    return tail_call;
+}
+
+// Calls the procedure under argc arguments on eval_stack, popping all of
+// them, and keeps following tail calls out of analyzed bodies until one
+// returns a value. The running lambda node is PROTECTed so its body stays
+// alive even if the procedure is redefined while it runs.
+Object *call_analyzed(int argc)
+{
+    char here;
+    if ((size_t)(analyze_stack_base - &here) > analyze_stack_limit) {
+        report_error("Recursion too deep.");
+        eval_sp -= argc + 1;
+        return nill;
+    }
+    Object *lambda = nill;
+    Object *env = nill;
+    PROTECT(lambda);
+    PROTECT(env);
+    char profiled = 0; // whether the running body has a profile frame
+    while (1) {
+        Object *proc = eval_stack[eval_sp - argc - 1];
+        if (!is_analyzed_procedure(proc)) {
+            if (profiled)
+                profile_exit();
+            UNPROTECT(2);
+            return call_procedure(argc);
+        }
+        lambda = closure_lambda(proc);
+        Object **parts = node_parts(lambda);
+        int arity = fixnum_value(parts[3]);
+        if (argc != arity && !check_application(proc, argc)) {
+            if (profiled)
+                profile_exit();
+            eval_sp -= argc + 1;
+            UNPROTECT(2);
+            return nill;
+        }
+        applications++;
+        env = bind_arguments(parts[0], fixnum_value(parts[2]), arity, argc,
+                closure_environment(proc));
+        // a tail call replaces its caller's profile frame
+        if (profiled)
+            profile_exit();
+        profiled = profiling;
+        if (profiled)
+            profile_enter(parts[4]);
+        Object *val = execute(parts[1], env);
+        if (val != tail_call) {
+            if (profiled)
+                profile_exit();
+            UNPROTECT(2);
+            return val;
+        }
+        argc = tail_call_argc;
+    }
+}
+
+// A node with one part that needs no analysis.
+Object *analyze_leaf(Object* (*execute)(Object*, Object*), Object *part)
+{
+    PROTECT(part);
+    Object *node = new_node(execute, 1);
+    UNPROTECT(1);
+    node_parts(node)[0] = part;
+    return node;
+}
+
+// The subexpressions in exprs, with the last one in tail position.
+Object *analyze_sequence(Object *exprs, char tail)
+{
+    int count = list_length(exprs);
+    if (count == 1)
+        return analyze(car(exprs), tail);
+    PROTECT(exprs);
+    Object *node = new_node(execute_sequence, count);
+    PROTECT(node);
+    for (int i = 0; i < count; i++, exprs = cdr(exprs))
+        node_parts(node)[i] = analyze(car(exprs), tail && i == count - 1);
+    UNPROTECT(2);
+    return node;
+}
+
+Object *analyze_application(Object *expr, char tail)
+{
+    PROTECT(expr);
+    Object *node = new_node(tail ? execute_tail_application : execute_application,
+            list_length(expr));
+    PROTECT(node);
+    for (int i = 0; is_pair(expr); i++, expr = cdr(expr))
+        node_parts(node)[i] = analyze(car(expr), 0);
+    UNPROTECT(2);
+    return node;
+}
+
+Object *analyze(Object *expr, char tail)
+{
+    if (is_self_evaluating(expr))
+        return analyze_leaf(execute_constant, expr);
+    if (is_local_ref(expr))
+        return analyze_leaf(execute_local_ref, expr);
+    if (is_global_ref(expr))
+        return analyze_leaf(execute_global_ref, expr->value.global_ref.binding);
+    if (is_quoted(expr))
+        return analyze_leaf(execute_constant, quotation_text(expr));
+    if (is_symbol(expr))
+        return analyze_leaf(execute_variable, expr);
+
+    Object *node = nill;
+    PROTECT(expr);
+    PROTECT(node);
+    if (is_if(expr)) {
+        node = new_node(execute_if, 3);
+        node_parts(node)[0] = analyze(if_test(expr), 0);
+        node_parts(node)[1] = analyze(if_consequent(expr), tail);
+        node_parts(node)[2] = analyze(if_subsequent(expr), tail);
+    }
+    else if (is_lambda(expr)) {
+        // frame layout, body, frame size, arity and name
+        node = new_node(execute_lambda, 5);
+        node_parts(node)[0] = resolved_lambda_frame(expr);
+        node_parts(node)[1] = analyze_sequence(resolved_lambda_body(expr), 1);
+        node_parts(node)[2] = new_int(list_length(resolved_lambda_frame(expr)));
+        node_parts(node)[3] = new_int(resolved_lambda_arity(expr));
+        node_parts(node)[4] = resolved_lambda_name(expr);
+    }
+    else if (is_definition(expr)) {
+        node = new_node(execute_definition, 2);
+        node_parts(node)[0] = definition_variable(expr);
+        node_parts(node)[1] = analyze(definition_value(expr), 0);
+    }
+    else if (is_assignment(expr)) {
+        node = new_node(execute_assignment, 2);
+        node_parts(node)[0] = assignment_variable(expr);
+        node_parts(node)[1] = analyze(assignment_value(expr), 0);
+    }
+    else if (is_application(expr)) {
+        node = analyze_application(expr, tail);
+    }
+    else {
+        report_error("I don't know how to analyze this expr.");
+        node = analyze_leaf(execute_constant, nill);
+    }
+    UNPROTECT(2);
+    return node;
+}
+
+// Where the depth check in call_analyzed measures from. Set for every
+// top-level expression in every mode, since analyzed closures loaded from a
+// heap image run under eval and the VM too.
+void set_analyze_stack_base(char *base)
+{
+    struct rlimit stack;
+    analyze_stack_base = base;
+    analyze_stack_limit = 8 << 20;
+    if (getrlimit(RLIMIT_STACK, &stack) == 0 && stack.rlim_cur != RLIM_INFINITY)
+        analyze_stack_limit = stack.rlim_cur;
+    // leave room for the frames of whatever the deepest call runs
+    analyze_stack_limit -= analyze_stack_limit / 4;
+}
+
+Object *analyze_execute(Object *expr)
+{
+    Object *node = analyze(expr, 0);
+    PROTECT(node);
+    Object *result = execute(node, the_global_environment);
+    UNPROTECT(1);
+    return result;
+}
+
+// ..............................Bytecode VM...................................
+// An alternative to eval selected with --vm. Each top-level expression is
+// resolved, compiled once into a CODE object and run by a stack machine
+// sharing eval_stack with the evaluator: operands and call frames (the
+// caller's code, pc and environment) live there, and FRAMEs are the same as
+// eval's, so both can call each other's procedures.
+typedef enum Opcode {
+    OP_CONST,           // k: push constants[k]
+    OP_LOCAL,           // depth index: push a local
+    OP_GLOBAL,          // k: push the value of the global binding constants[k]
+    OP_SET_LOCAL,       // depth index: pop into a local, push ()
+    OP_SET_GLOBAL,      // k: pop into the global binding constants[k], push ()
+    OP_DEFINE_GLOBAL,   // k: same, but the binding may still be unassigned
+    OP_POP,
+    OP_JUMP,            // target
+    OP_JUMP_IF_FALSE,   // target: pop, jump if #f
+    OP_CLOSURE,         // k: push a procedure over constants[k] and env
+    OP_CALL,            // argc: call the procedure under the arguments
+    OP_TAIL_CALL,       // argc: same, replacing the current call frame
+    OP_RETURN,
+    OP_ADD,             // k: inline primitive bound by constants[k]; the five
+    OP_SUB,             //    must stay in inline_primitives order
+    OP_LT,
+    OP_GT,
+    OP_NUM_EQ
+} Opcode;
+
+void init_inline_primitives(void)
+{
+    for (size_t i = 0; i < NUM_INLINE_PRIMITIVES; i++)
+        inline_primitives[i].builtin = cdr(global_binding(intern(inline_primitives[i].name)));
+}
+
+int inline_opcode(Object *name)
+{
+    for (size_t i = INLINE_ADD; i <= INLINE_NUM_EQ; i++) {
+        if (name == intern(inline_primitives[i].name))
+            return OP_ADD + i;
+    }
+    return -1;
+}
+
+Object *new_code(Object *names, char toplevel)
+{
+    PROTECT(names);
+    Object *new_obj = alloc_object(CODE);
+    UNPROTECT(1);
+    Bytecode *bc = malloc(sizeof(Bytecode));
+    bc->length = 0;
+    bc->capacity = 32;
+    bc->code = malloc(bc->capacity * sizeof(int));
+    bc->nconstants = 0;
+    bc->constants_capacity = 8;
+    bc->constants = malloc(bc->constants_capacity * sizeof(Object*));
+    bc->names = names;
+    bc->frame_size = list_length(names);
+    bc->arity = 0;
+    bc->name = nill;
+    bc->toplevel = toplevel;
+    new_obj->value.bytecode = bc;
+    return new_obj;
+}
+
+void emit(Bytecode *bc, int word)
+{
+    if (bc->length == bc->capacity) {
+        bc->capacity *= 2;
+        bc->code = realloc(bc->code, bc->capacity * sizeof(int));
+    }
+    bc->code[bc->length++] = word;
+}
+
+int add_constant(Bytecode *bc, Object *obj)
+{
+    for (int i = 0; i < bc->nconstants; i++) {
+        if (bc->constants[i] == obj)
+            return i;
+    }
+    if (bc->nconstants == bc->constants_capacity) {
+        bc->constants_capacity *= 2;
+        bc->constants = realloc(bc->constants, bc->constants_capacity * sizeof(Object*));
+    }
+    bc->constants[bc->nconstants] = obj;
+    return bc->nconstants++;
+}
+
+void compile(Object *expr, Object *code, char tail);
+
+// A body in tail position: every value but the last is dropped.
+void compile_body(Object *body, Object *code)
+{
+    PROTECT(body);
+    PROTECT(code);
+    while (!is_last_exp(body)) {
+        compile(car(body), code, 0);
+        emit(code->value.bytecode, OP_POP);
+        body = cdr(body);
+    }
+    compile(car(body), code, 1);
+    UNPROTECT(2);
+}
+
+// Compiles a resolved expression. Code in tail position ends by returning
+// (or tail calling) itself; otherwise it leaves its value on the stack.
+void compile(Object *expr, Object *code, char tail)
+{
+    Bytecode *bc = code->value.bytecode;
+    PROTECT(expr);
+    PROTECT(code);
+    if (is_self_evaluating(expr)) {
+        emit(bc, OP_CONST);
+        emit(bc, add_constant(bc, expr));
+    }
+    else if (is_local_ref(expr)) {
+        emit(bc, OP_LOCAL);
+        emit(bc, expr->value.ref.depth);
+        emit(bc, expr->value.ref.index);
+    }
+    else if (is_global_ref(expr) || is_symbol(expr)) {
+        emit(bc, OP_GLOBAL);
+        emit(bc, add_constant(bc, is_symbol(expr) ? global_cell(expr)
+                    : expr->value.global_ref.binding));
+    }
+    else if (is_quoted(expr)) {
+        emit(bc, OP_CONST);
+        emit(bc, add_constant(bc, quotation_text(expr)));
+    }
+    else if (is_if(expr)) {
+        compile(if_test(expr), code, 0);
+        emit(bc, OP_JUMP_IF_FALSE);
+        int else_jump = bc->length;
+        emit(bc, 0);
+        compile(if_consequent(expr), code, tail);
+        int end_jump = -1;
+        if (!tail) {
+            emit(bc, OP_JUMP);
+            end_jump = bc->length;
+            emit(bc, 0);
+        }
+        bc->code[else_jump] = bc->length;
+        compile(if_subsequent(expr), code, tail);
+        if (!tail)
+            bc->code[end_jump] = bc->length;
+        UNPROTECT(2);
+        return;
+    }
+    else if (is_lambda(expr)) {
+        Object *body_code = new_code(resolved_lambda_frame(expr), 0);
+        PROTECT(body_code);
+        body_code->value.bytecode->arity = resolved_lambda_arity(expr);
+        body_code->value.bytecode->name = resolved_lambda_name(expr);
+        compile_body(resolved_lambda_body(expr), body_code);
+        emit(bc, OP_CLOSURE);
+        emit(bc, add_constant(bc, body_code));
+        UNPROTECT(1);
+    }
+    else if (is_definition(expr)) {
+        Object *var = definition_variable(expr);
+        compile(definition_value(expr), code, 0);
+        if (bc->toplevel) {
+            emit(bc, OP_DEFINE_GLOBAL);
+            emit(bc, add_constant(bc, global_cell(var)));
+        }
+        else {
+            // resolve() gave every internal definition a slot up front
+            int index = list_index(var, bc->names);
+            if (index < 0)
+                report_error("define of %s is not at the start of a body.", var->value.symbol);
+            emit(bc, OP_SET_LOCAL);
+            emit(bc, 0);
+            emit(bc, index < 0 ? 0 : index);
+        }
+    }
+    else if (is_assignment(expr)) {
+        Object *var = assignment_variable(expr);
+        compile(assignment_value(expr), code, 0);
+        if (is_local_ref(var)) {
+            emit(bc, OP_SET_LOCAL);
+            emit(bc, var->value.ref.depth);
+            emit(bc, var->value.ref.index);
+        }
+        else {
+            emit(bc, OP_SET_GLOBAL);
+            emit(bc, add_constant(bc, is_symbol(var) ? global_cell(var)
+                        : var->value.global_ref.binding));
+        }
+    }
+    else if (is_application(expr)) {
+        Object *operator = car(expr);
+        int argc = list_length(cdr(expr));
+        int opcode = -1;
+        if (is_global_ref(operator) && argc == 2)
+            opcode = inline_opcode(operator->value.global_ref.name);
+        if (opcode < 0)
+            compile(operator, code, 0);
+        for (Object *args = cdr(expr); !is_nill(args); args = cdr(args))
+            compile(car(args), code, 0);
+        if (opcode >= 0) {
+            emit(bc, opcode);
+            emit(bc, add_constant(bc, operator->value.global_ref.binding));
+        }
+        else {
+            emit(bc, tail ? OP_TAIL_CALL : OP_CALL);
+            emit(bc, argc);
+            if (tail) {
+                UNPROTECT(2);
+                return;
+            }
+        }
+    }
+    else {
+        report_error("I don't know how to compile this expr.");
+        emit(bc, OP_CONST);
+        emit(bc, add_constant(bc, nill));
+    }
+    if (tail)
+        emit(bc, OP_RETURN);
+    UNPROTECT(2);
+}
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+#define VM_CASE(op) label_##op:
+#define VM_NEXT() do { steps++; goto *dispatch_table[code[pc++]]; } while (0)
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT() goto vm_dispatch
+#endif
+
+// fits computes result from fixnums a and b and fails if it overflows; then,
+// or when the operands are not fixnums or the global was redefined, the
+// builtin is called as usual.
+#define VM_BINARY_FIXNUM_OP(op, fits)                                          \
+    {                                                                          \
+        Object *a = eval_stack[eval_sp - 2];                                   \
+        Object *b = eval_stack[eval_sp - 1];                                   \
+        Object *result;                                                        \
+        Object *binding = bc->constants[code[pc++]];                           \
+        if (is_fixnum(a) && is_fixnum(b)                                       \
+                && cdr(binding) == inline_primitives[op - OP_ADD].builtin      \
+                && (fits)) {                                                   \
+            eval_sp--;                                                         \
+            eval_stack[eval_sp - 1] = result;                                  \
+        }                                                                      \
+        else {                                                                 \
+            save(b);                                                           \
+            eval_stack[eval_sp - 2] = a;                                       \
+            eval_stack[eval_sp - 3] = cdr(binding);                            \
+            save(call_procedure(2));                                           \
+        }                                                                      \
+        VM_NEXT();                                                             \
+    }
+
+// Tagged fixnums compare like the integers they encode.
+#define FIXNUM_COMPARE(cmp) \
+    (result = new_boolean((intptr_t)a cmp (intptr_t)b), 1)
+
+// Runs code in env until it returns from its outermost call frame.
+Object *vm_run(Object *code_obj, Object *env)
+{
+    Object *val = nill;
+    Object *proc = nill;
+    PROTECT(code_obj);
+    PROTECT(env);
+    PROTECT(val);
+    PROTECT(proc);
+    Bytecode *bc = code_obj->value.bytecode;
+    int *code = bc->code;
+    int pc = 0;
+    int depth = 0;
+    int argc = 0;
+    char tail = 0;
+    size_t steps = 0; // added to eval_steps on the way out
+#ifdef USE_COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        &&label_OP_CONST, &&label_OP_LOCAL, &&label_OP_GLOBAL,
+        &&label_OP_SET_LOCAL, &&label_OP_SET_GLOBAL, &&label_OP_DEFINE_GLOBAL,
+        &&label_OP_POP, &&label_OP_JUMP, &&label_OP_JUMP_IF_FALSE,
+        &&label_OP_CLOSURE, &&label_OP_CALL, &&label_OP_TAIL_CALL,
+        &&label_OP_RETURN, &&label_OP_ADD, &&label_OP_SUB, &&label_OP_LT,
+        &&label_OP_GT, &&label_OP_NUM_EQ
+    };
+    VM_NEXT();
+#else
+vm_dispatch:
+    steps++;
+    switch (code[pc++]) {
+#endif
+
+    VM_CASE(OP_CONST)
+        save(bc->constants[code[pc++]]);
+        VM_NEXT();
+
+    VM_CASE(OP_LOCAL)
+    {
+        Object *frame = env;
+        for (int depth = code[pc++]; depth > 0; depth--)
+            frame = frame->value.frame.parent;
+        int index = code[pc++];
+        Object *value = frame_slots(frame)[index];
+        if (value == unassigned)
+            value = frame_value(list_ref(frame->value.frame.names, index), value);
+        save(value);
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_GLOBAL)
+        save(binding_value(bc->constants[code[pc++]]));
+        VM_NEXT();
+
+    VM_CASE(OP_SET_LOCAL)
+    {
+        Object *frame = env;
+        for (int depth = code[pc++]; depth > 0; depth--)
+            frame = frame->value.frame.parent;
+        frame_slots(frame)[code[pc++]] = eval_stack[eval_sp - 1];
+        eval_stack[eval_sp - 1] = nill;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_SET_GLOBAL)
+        set_global(bc->constants[code[pc++]], eval_stack[eval_sp - 1]);
+        eval_stack[eval_sp - 1] = nill;
+        VM_NEXT();
+
+    VM_CASE(OP_DEFINE_GLOBAL)
+        set_cdr(bc->constants[code[pc++]], eval_stack[eval_sp - 1]);
+        eval_stack[eval_sp - 1] = nill;
+        VM_NEXT();
+
+    VM_CASE(OP_POP)
+        eval_sp--;
+        VM_NEXT();
+
+    VM_CASE(OP_JUMP)
+        pc = code[pc];
+        VM_NEXT();
+
+    VM_CASE(OP_JUMP_IF_FALSE)
+        if (restore() == false_obj)
+            pc = code[pc];
+        else
+            pc++;
+        VM_NEXT();
+
+    VM_CASE(OP_CLOSURE)
+        val = new_closure(bc->constants[code[pc++]], env);
+        save(val);
+        VM_NEXT();
+
+    VM_CASE(OP_CALL)
+        argc = code[pc++];
+        tail = 0;
+        goto vm_call;
+
+    VM_CASE(OP_TAIL_CALL)
+        argc = code[pc++];
+        tail = 1;
+        goto vm_call;
+
+    VM_CASE(OP_RETURN)
+        goto vm_return;
+
+    VM_CASE(OP_ADD) VM_BINARY_FIXNUM_OP(OP_ADD, fixnum_add(a, b, &result))
+    VM_CASE(OP_SUB) VM_BINARY_FIXNUM_OP(OP_SUB, fixnum_sub(a, b, &result))
+    VM_CASE(OP_LT) VM_BINARY_FIXNUM_OP(OP_LT, FIXNUM_COMPARE(<))
+    VM_CASE(OP_GT) VM_BINARY_FIXNUM_OP(OP_GT, FIXNUM_COMPARE(>))
+    VM_CASE(OP_NUM_EQ) VM_BINARY_FIXNUM_OP(OP_NUM_EQ, FIXNUM_COMPARE(==))
+
+#ifndef USE_COMPUTED_GOTO
+    }
+#endif
+
+vm_call:
+    proc = eval_stack[eval_sp - argc - 1];
+    if (is_compiled_procedure(proc)) {
+        Object *callee = closure_lambda(proc);
+        Bytecode *callee_bc = callee->value.bytecode;
+        if (argc != callee_bc->arity && !check_application(proc, argc)) {
+            eval_sp -= argc + 1;
+            save(nill);
+            if (!tail)
+                VM_NEXT();
+            goto vm_return;
+        }
+        applications++;
+        val = bind_arguments(callee_bc->names, callee_bc->frame_size, callee_bc->arity, argc,
+                closure_environment(proc));
+        if (profiling) {
+            if (tail && !bc->toplevel)
+                profile_exit();
+            profile_enter(callee_bc->name);
+        }
+        if (!tail) {
+            save(code_obj);
+            save(new_int(pc));
+            save(env);
+            depth++;
+        }
+        code_obj = callee;
+        bc = callee_bc;
+        code = bc->code;
+        pc = 0;
+        env = val;
+        VM_NEXT();
+    }
+    val = call_procedure(argc);
+    save(val);
+    if (!tail)
+        VM_NEXT();
+
+vm_return:
+    if (profiling && !bc->toplevel)
+        profile_exit();
+    val = restore();
+    if (depth == 0) {
+        eval_steps += steps;
+        UNPROTECT(4);
+        return val;
+    }
+    env = restore();
+    pc = fixnum_value(restore());
+    code_obj = restore();
+    bc = code_obj->value.bytecode;
+    code = bc->code;
+    depth--;
+    save(val);
+    VM_NEXT();
+}
+
+// Runs the compiled procedure under argc arguments on eval_stack.
+Object *vm_apply(int argc)
+{
+    Object *proc = eval_stack[eval_sp - argc - 1];
+    Object *code = closure_lambda(proc);
+    Bytecode *bc = code->value.bytecode;
+    PROTECT(code);
+    Object *env = bind_arguments(bc->names, bc->frame_size, bc->arity, argc,
+            closure_environment(proc));
+    UNPROTECT(1);
+    if (profiling)
+        profile_enter(bc->name);
+    return vm_run(code, env);
+}
+
+Object *vm_execute(Object *expr)
+{
+    Object *code = new_code(nill, 1);
+    PROTECT(code);
+    compile(expr, code, 1);
+    Object *result = vm_run(code, the_global_environment);
+    UNPROTECT(1);
+    return result;
+}
+
+// ....................................PRINT...................................
+// Output goes through ports that collect it in their own buffer and hand it
+// to stdio in large writes. A port with no file is a string port and just
+// keeps growing; the OutputPort struct is with the string builtins.
+#define PORT_FLUSH_SIZE (64 * 1024)
+
+OutputPort *stdout_port;
+
+OutputPort *new_output_port(FILE *file)
+{
+    OutputPort *port = malloc(sizeof(OutputPort));
+    port->file = file;
+    port->length = 0;
+    port->capacity = 256;
+    port->buffer = malloc(port->capacity);
+    return port;
+}
+
+void free_output_port(OutputPort *port)
+{
+    free(port->buffer);
+    free(port);
+}
+
+void flush_port(OutputPort *port)
+{
+    if (port->file && port->length) {
+        fwrite(port->buffer, 1, port->length, port->file);
+        fflush(port->file);
+        port->length = 0;
+    }
+}
+
+void port_write(OutputPort *port, const char *s, size_t n)
+{
+    if (port->length + n > port->capacity) {
+        if (port->file && port->length + n > PORT_FLUSH_SIZE) {
+            fwrite(port->buffer, 1, port->length, port->file);
+            port->length = 0;
+            if (n > PORT_FLUSH_SIZE) {
+                fwrite(s, 1, n, port->file);
+                return;
+            }
+        }
+        while (port->length + n > port->capacity)
+            port->capacity *= 2;
+        port->buffer = realloc(port->buffer, port->capacity);
+    }
+    memcpy(port->buffer + port->length, s, n);
+    port->length += n;
+}
+
+void port_puts(OutputPort *port, const char *s)
+{
+    port_write(port, s, strlen(s));
+}
+
+void port_putc(OutputPort *port, char c)
+{
+    port_write(port, &c, 1);
+}
+
+void flush_stdout_port(void)
+{
+    flush_port(stdout_port);
+}
+
+// write shows strings and characters as the reader would read them back.
+void print_string(OutputPort *port, const char *s, size_t length, char write)
+{
+    if (!write) {
+        port_write(port, s, length);
+        return;
+    }
+    const char *end = s + length;
+    port_putc(port, '"');
+    for (; s < end; s++) {
+        if (*s == '"' || *s == '\\')
+            port_putc(port, '\\');
+        if (*s == '\n')
+            port_puts(port, "\\n");
+        else
+            port_putc(port, *s);
+    }
+    port_putc(port, '"');
+}
+
+void print_char(OutputPort *port, char c, char write)
+{
+    if (!write)
+        port_putc(port, c);
+    else if (c == ' ')
+        port_puts(port, "#\\space");
+    else if (c == '\n')
+        port_puts(port, "#\\newline");
+    else {
+        port_puts(port, "#\\");
+        port_putc(port, c);
+    }
+}
+
+// Peels off nine decimal digits at a time from the low end.
+void print_bignum(OutputPort *port, Object *n)
+{
+    int length = n->value.bignum.length;
+    uint32_t *magnitude = malloc(length * sizeof(uint32_t));
+    memcpy(magnitude, n->value.bignum.digits, length * sizeof(uint32_t));
+    uint32_t *chunks = malloc((length * 10 / 9 + 2) * sizeof(uint32_t));
+    int nchunks = 0;
+    do {
+        chunks[nchunks++] = mag_div_digit(magnitude, length, 1000000000);
+        length = mag_length(magnitude, length);
+    } while (length > 0);
+    char text[16];
+    if (n->value.bignum.sign < 0)
+        port_putc(port, '-');
+    port_write(port, text, sprintf(text, "%u", chunks[nchunks - 1]));
+    for (int i = nchunks - 2; i >= 0; i--)
+        port_write(port, text, sprintf(text, "%09u", chunks[i]));
+    free(chunks);
+    free(magnitude);
+}
+
+// The shortest form that reads back as the same double, always with a
+// point or exponent so it reads back as a flonum. The infinities and NaN
+// are written +inf.0, -inf.0 and +nan.0, which the reader knows.
+void print_flonum(OutputPort *port, double d)
+{
+    if (isnan(d)) {
+        port_puts(port, "+nan.0");
+        return;
+    }
+    if (isinf(d)) {
+        port_puts(port, d > 0 ? "+inf.0" : "-inf.0");
+        return;
+    }
+    char text[32];
+    for (int precision = 1; precision <= 17; precision++) {
+        snprintf(text, sizeof(text), "%.*g", precision, d);
+        if (strtod(text, NULL) == d)
+            break;
+    }
+    port_puts(port, text);
+    if (!strpbrk(text, ".e"))
+        port_puts(port, ".0");
+}
+
+// Elements are printed straight from memory, without boxing them.
+void print_numeric_vector(OutputPort *port, Object *vector)
+{
+    char number[32];
+    size_t n = vector_length(vector);
+    port_puts(port, is_s64vector(vector) ? "#s64(" : "#f64(");
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0)
+            port_putc(port, ' ');
+        if (is_s64vector(vector))
+            port_write(port, number, sprintf(number, "%lld", (long long)s64vector_elements(vector)[i]));
+        else
+            print_flonum(port, f64vector_elements(vector)[i]);
+    }
+    port_putc(port, ')');
+}
+
+// Objects other than pairs, which print_object takes apart itself.
+void print_atom(OutputPort *port, Object *expr, char write)
+{
+    char number[32];
+    if (is_fixnum(expr)) {
+        port_write(port, number, sprintf(number, "%ld", fixnum_value(expr)));
+    }
+    else if (is_bignum(expr)) {
+        print_bignum(port, expr);
+    }
+    else if (is_flonum(expr)) {
+        print_flonum(port, expr->value.flonum);
+    }
+    else if (is_boolean(expr)) {
+        port_puts(port, expr == true_obj ? "#t" : "#f");
+    }
+    else if (expr == eof_object) {
+        port_puts(port, "#<eof>");
+    }
+    else if (is_char(expr)) {
+        print_char(port, char_value(expr), write);
+    }
+    else if (is_string(expr)) {
+        print_string(port, expr->value.string.chars, expr->value.string.length, write);
+    }
+    else if (is_symbol(expr)) {
+        port_puts(port, expr->value.symbol);
+    }
+    else if (is_local_ref(expr) || is_global_ref(expr)) {
+        port_puts(port, expr->value.ref.name->value.symbol);
+    }
+    else if (has_type(expr, CODE)) {
+        port_puts(port, "#<bytecode>");
+    }
+    else if (has_type(expr, NODE)) {
+        port_puts(port, "#<analyzed>");
+    }
+    else if (has_type(expr, NATIVE)) {
+        port_puts(port, "#<native>");
+    }
+    else if (has_type(expr, PORT)) {
+        port_puts(port, "#<string-port>");
+    }
+    else if (has_type(expr, HASHTABLE)) {
+        char text[48];
+        port_write(port, text, sprintf(text, "#<hash-table %zu>", expr->value.hash_table->count));
+    }
+    else if (is_nill(expr)) {
+        port_puts(port, "()");
+    }
+    else {
+        port_puts(port, "I don't know how to display this yet :(");
+    }
+}
+
+// print_object walks nested data with an explicit stack of what is left to
+// print, so its C stack use does not depend on the shape of the data.
+typedef enum PrintTask {
+    PRINT_DATUM,  // print obj
+    PRINT_REST,   // print the rest of a list whose head was just printed
+    PRINT_TEXT    // emit text
+} PrintTask;
+
+typedef struct PrintItem {
+    PrintTask task;
+    Object *obj;
+    const char *text;
+} PrintItem;
+
+PrintItem *print_stack;
+size_t print_stack_capacity;
+
+static inline void push_print(size_t *sp, PrintTask task, Object *obj, const char *text)
+{
+    if (*sp == print_stack_capacity) {
+        print_stack_capacity = print_stack_capacity ? 2 * print_stack_capacity : 256;
+        print_stack = realloc(print_stack, print_stack_capacity * sizeof(PrintItem));
+    }
+    print_stack[*sp].task = task;
+    print_stack[*sp].obj = obj;
+    print_stack[*sp].text = text;
+    ++*sp;
+}
+
+void print_object(OutputPort *port, Object *expr, char write)
+{
+    size_t sp = 0;
+    push_print(&sp, PRINT_DATUM, expr, NULL);
+    while (sp > 0) {
+        PrintItem item = print_stack[--sp];
+        Object *obj = item.obj;
+        if (item.task == PRINT_TEXT) {
+            port_puts(port, item.text);
+        }
+        else if (item.task == PRINT_REST) {
+            if (is_nill(obj)) {
+                port_putc(port, ')');
+            }
+            else if (is_pair(obj)) {
+                port_putc(port, ' ');
+                push_print(&sp, PRINT_REST, cdr(obj), NULL);
+                push_print(&sp, PRINT_DATUM, car(obj), NULL);
+            }
+            else {
+                port_puts(port, " . ");
+                push_print(&sp, PRINT_TEXT, NULL, ")");
+                push_print(&sp, PRINT_DATUM, obj, NULL);
+            }
+        }
+        else if (is_primitive_procedure(obj) || has_type(obj, CLOSURE)) {
+            char *name = procedure_name(obj);
+            port_puts(port, is_primitive_procedure(obj) ? "#<primitive" : "#<procedure");
+            if (name != NULL) {
+                port_putc(port, ' ');
+                port_puts(port, name);
+            }
+            port_putc(port, '>');
+        }
+        else if (is_pair(obj)) {
+            port_putc(port, '(');
+            push_print(&sp, PRINT_REST, cdr(obj), NULL);
+            push_print(&sp, PRINT_DATUM, car(obj), NULL);
+        }
+        else if (is_vector(obj)) {
+            Object **elements = vector_elements(obj);
+            port_puts(port, "#(");
+            push_print(&sp, PRINT_TEXT, NULL, ")");
+            for (size_t i = vector_length(obj); i-- > 0;) {
+                push_print(&sp, PRINT_DATUM, elements[i], NULL);
+                if (i > 0)
+                    push_print(&sp, PRINT_TEXT, NULL, " ");
+            }
+        }
+        else if (is_s64vector(obj) || is_f64vector(obj)) {
+            print_numeric_vector(port, obj);
+        }
+        else if (has_type(obj, FRAME)) {
+            port_puts(port, "#<frame ");
+            push_print(&sp, PRINT_TEXT, NULL, ">");
+            push_print(&sp, PRINT_DATUM, obj->value.frame.names, NULL);
+        }
+        else if (has_type(obj, GLOBAL_ENV)) {
+            // shown as the association list it replaced, for debugging
+            BindingTable *table = obj->value.table;
+            char any = 0;
+            port_putc(port, '(');
+            push_print(&sp, PRINT_TEXT, NULL, ")");
+            for (size_t i = table->size; i-- > 0;) {
+                if (table->bindings[i]) {
+                    if (any)
+                        push_print(&sp, PRINT_TEXT, NULL, " ");
+                    push_print(&sp, PRINT_DATUM, table->bindings[i], NULL);
+                    any = 1;
+                }
+            }
+        }
+        else {
+            print_atom(port, obj, write);
+        }
+    }
+}
+
+void display(Object *expr)
+{
+    print_object(stdout_port, expr, 0);
+}
+
+void write_object(Object *expr)
+{
+    print_object(stdout_port, expr, 1);
+}
+
+void newline(void)
+{
+    port_putc(stdout_port, '\n');
+}
+
+// ..............................Heap images...................................
+// (dump-image "file") writes everything reachable from the global
+// environment to file, and starting with --image file maps it back in
+// instead of defining the builtins, so a prelude loaded once costs nothing
+// at later startups.
+// An image is a header, the objects' cells laid end to end, each followed by
+// what it owns outside the heap (symbol names, bignum digits, tables,
+// bytecode), and a table of the objects' offsets. Every pointer is written
+// as IMAGE_BASE plus the offset of its target in the file. The loader asks
+// mmap for the file at IMAGE_BASE, in which case the pointers are already
+// right, and otherwise moves them all by the same amount in one pass.
+// Either way primitives and analyzer nodes get their C pointers back from an
+// index, symbols are entered in the symbol table, and the binding and hash
+// tables, which hash by address, are rebuilt in malloced memory. Closures
+// keep the template of the mode that made them; call_procedure runs those
+// in any mode.
+#define IMAGE_MAGIC "c_scheme image\n"
+#define IMAGE_BASE ((uintptr_t)0x200000000000)
+
+typedef struct ImageHeader {
+    char magic[16];
+    uint64_t size;               // of the whole file
+    uint64_t signature;          // image_signature() of the binary that wrote it
+    uint64_t global_environment; // as a pointer
+    uint64_t object_count;
+    uint64_t objects;            // offset of the table of object offsets
+} ImageHeader;
+
+char *image_path;
+
+Object* (*const node_executors[])(Object*, Object*) = {
+    execute_constant, execute_local_ref, execute_global_ref, execute_variable,
+    execute_if, execute_lambda, execute_definition, execute_assignment,
+    execute_sequence, execute_application, execute_tail_application,
+};
+
+#define NUM_NODE_EXECUTORS (sizeof(node_executors) / sizeof(node_executors[0]))
+#define NUM_BUILTINS (sizeof(builtins) / sizeof(builtins[0]))
+
+// An image only makes sense to the binary that wrote it: primitives and
+// nodes are stored as indexes, bytecode as opcodes.
+uint64_t image_signature(void)
+{
+    uint64_t h = hash_bytes(&(size_t[]){NUM_BUILTINS, NUM_NODE_EXECUTORS, OP_NUM_EQ,
+                                        sizeof(Object), sizeof(Bytecode)}, 5 * sizeof(size_t));
+    for (size_t i = 0; i < NUM_BUILTINS; i++)
+        h = h * 31 + hash_string(builtins[i].name);
+    return h;
+}
+
+static inline size_t bytes_to_cells(size_t bytes)
+{
+    return (bytes + sizeof(Object) - 1) / sizeof(Object);
+}
+
+static inline size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+// Cells spanned by obj, worked out from its contents, so it holds for slab,
+// large and image objects alike.
+size_t object_cells(Object *obj)
+{
+    switch (obj->type) {
+        case FRAME:
+            return 1 + bytes_to_cells(list_length(obj->value.frame.names) * sizeof(Object*));
+        case NODE:
+            return 1 + bytes_to_cells(obj->value.node.count * sizeof(Object*));
+        case VECTOR:
+        case S64VECTOR:
+        case F64VECTOR:
+            return 1 + bytes_to_cells(vector_length(obj) * sizeof(Object*));
+        case STRING:
+            return string_base(obj) == obj ? 1 + bytes_to_cells(obj->value.string.length) : 2;
+        default:
+            return 1;
+    }
+}
+
+// Bytes obj owns outside the heap, written after its cells.
+size_t image_extra_bytes(Object *obj)
+{
+    switch (obj->type) {
+        case SYMBOL:
+            return align8(strlen(obj->value.symbol) + 1);
+        case BIGNUM:
+            return align8(obj->value.bignum.length * sizeof(uint32_t));
+        case GLOBAL_ENV:
+            return sizeof(BindingTable) + obj->value.table->size * sizeof(Object*);
+        case HASHTABLE:
+            return sizeof(HashTable) + obj->value.hash_table->size * sizeof(HashEntry);
+        case PORT:
+            return sizeof(OutputPort) + align8(obj->value.port->length);
+        case CODE:
+            return align8(sizeof(Bytecode)) + align8(obj->value.bytecode->length * sizeof(int))
+                   + obj->value.bytecode->nconstants * sizeof(Object*);
+        default:
+            return 0;
+    }
+}
+
+// ..........Writing
+typedef struct ImageWriter {
+    Object **objects;   // in the order they are written
+    size_t count;
+    size_t capacity;
+    Object **keys;      // open-addressing map from object to its offset
+    uint64_t *offsets;
+    size_t map_size;
+    char *buffer;       // the whole file
+} ImageWriter;
+
+void image_add(ImageWriter *w, Object *obj)
+{
+    if (w->count == w->capacity) {
+        w->capacity = w->capacity ? 2 * w->capacity : 1024;
+        w->objects = realloc(w->objects, w->capacity * sizeof(Object*));
+    }
+    w->objects[w->count++] = obj;
+}
+
+// Everything reachable from root, found by marking from root alone. Marks
+// are all clear between collections and nothing here allocates, so the
+// marked objects are exactly those wanted; their marks are cleared again.
+void image_collect(ImageWriter *w, Object *root)
+{
+    gc_mark(root);
+#ifndef MALLOC_OBJECTS
+    retire_bump_run();
+    for (Slab *slab = slabs; slab; slab = slab->next) {
+        for (size_t i = 0; i < SLAB_OBJECTS; i += slab->objects[i].cells) {
+            if (slab->objects[i].marked)
+                image_add(w, &slab->objects[i]);
+        }
+    }
+#endif
+    for (LargeObject *large = large_objects; large; large = large->next) {
+        if (large->object->marked)
+            image_add(w, large->object);
+    }
+    for (size_t i = 0; i < image_object_count; i++) {
+        if (image_objects[i]->marked)
+            image_add(w, image_objects[i]);
+    }
+    for (size_t i = 0; i < w->count; i++)
+        w->objects[i]->marked = 0;
+}
+
+size_t image_map_index(ImageWriter *w, Object *obj)
+{
+    size_t mask = w->map_size - 1;
+    size_t i = hash_pointer(obj) & mask;
+    while (w->keys[i] && w->keys[i] != obj)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static inline uint64_t image_offset(ImageWriter *w, Object *obj)
+{
+    return w->offsets[image_map_index(w, obj)];
+}
+
+// obj as written in the image: immediates as they are, heap objects moved
+// to IMAGE_BASE.
+static inline Object *image_pointer(ImageWriter *w, Object *obj)
+{
+    if (!obj || !is_heap_object(obj))
+        return obj;
+    return (Object*)(IMAGE_BASE + image_offset(w, obj));
+}
+
+// Copies obj and what it owns to offset, translating every pointer. Fails
+// on an analyzer node whose executor is missing from node_executors, and on
+// a lambda compiled to C, since an image written by a compiled program
+// would load into c_scheme, which lacks its code.
+char image_write_object(ImageWriter *w, Object *obj, uint64_t offset)
+{
+    size_t cells = object_cells(obj);
+    Object *copy = (Object*)(w->buffer + offset);
+    memcpy(copy, obj, cells * sizeof(Object));
+    copy->marked = 0;
+    uint64_t extra = offset + cells * sizeof(Object);
+    char *data = w->buffer + extra;
+    switch (obj->type) {
+        case PRIMITIVE:
+            copy->value.primitive = (const Primitive*)(uintptr_t)(obj->value.primitive - builtins);
+            break;
+        case CLOSURE:
+            copy->value.closure.lambda = image_pointer(w, obj->value.closure.lambda);
+            copy->value.closure.env = image_pointer(w, obj->value.closure.env);
+            break;
+        case STRING: {
+            Object *base = string_base(obj);
+            copy->value.string.chars = (char*)(IMAGE_BASE + image_offset(w, base)
+                                               + (obj->value.string.chars - (char*)base));
+            if (base != obj)
+                *(Object**)(copy + 1) = image_pointer(w, base);
+            break;
+        }
+        case SYMBOL:
+            strcpy(data, obj->value.symbol);
+            copy->value.symbol = (char*)(IMAGE_BASE + extra);
+            break;
+        case PAIR:
+            copy->value.pair.car = image_pointer(w, obj->value.pair.car);
+            copy->value.pair.cdr = image_pointer(w, obj->value.pair.cdr);
+            break;
+        case LOCAL_REF:
+            copy->value.ref.name = image_pointer(w, obj->value.ref.name);
+            break;
+        case GLOBAL_REF:
+            copy->value.global_ref.name = image_pointer(w, obj->value.global_ref.name);
+            copy->value.global_ref.binding = image_pointer(w, obj->value.global_ref.binding);
+            break;
+        case FRAME: {
+            int n = list_length(obj->value.frame.names);
+            copy->value.frame.parent = image_pointer(w, obj->value.frame.parent);
+            copy->value.frame.names = image_pointer(w, obj->value.frame.names);
+            for (int i = 0; i < n; i++)
+                frame_slots(copy)[i] = image_pointer(w, frame_slots(obj)[i]);
+            break;
+        }
+        case GLOBAL_ENV: {
+            BindingTable *table = (BindingTable*)data;
+            Object **bindings = (Object**)(data + sizeof(BindingTable));
+            *table = *obj->value.table;
+            for (size_t i = 0; i < table->size; i++)
+                bindings[i] = image_pointer(w, obj->value.table->bindings[i]);
+            table->bindings = (Object**)(IMAGE_BASE + extra + sizeof(BindingTable));
+            copy->value.table = (BindingTable*)(IMAGE_BASE + extra);
+            break;
+        }
+        case CODE: {
+            Bytecode *from = obj->value.bytecode;
+            Bytecode *bc = (Bytecode*)data;
+            uint64_t code_at = extra + align8(sizeof(Bytecode));
+            uint64_t constants_at = code_at + align8(from->length * sizeof(int));
+            Object **constants = (Object**)(w->buffer + constants_at);
+            *bc = *from;
+            memcpy(w->buffer + code_at, from->code, from->length * sizeof(int));
+            for (int i = 0; i < from->nconstants; i++)
+                constants[i] = image_pointer(w, from->constants[i]);
+            bc->code = (int*)(IMAGE_BASE + code_at);
+            bc->capacity = from->length;
+            bc->constants = (Object**)(IMAGE_BASE + constants_at);
+            bc->constants_capacity = from->nconstants;
+            bc->names = image_pointer(w, from->names);
+            bc->name = image_pointer(w, from->name);
+            copy->value.bytecode = (Bytecode*)(IMAGE_BASE + extra);
+            break;
+        }
+        case NODE: {
+            size_t index = 0;
+            while (index < NUM_NODE_EXECUTORS && node_executors[index] != obj->value.node.execute)
+                index++;
+            if (index == NUM_NODE_EXECUTORS)
+                return 0;
+            copy->value.node.execute = (Object* (*)(Object*, Object*))index;
+            for (int i = 0; i < obj->value.node.count; i++)
+                node_parts(copy)[i] = image_pointer(w, node_parts(obj)[i]);
+            break;
+        }
+        case BIGNUM:
+            memcpy(data, obj->value.bignum.digits, obj->value.bignum.length * sizeof(uint32_t));
+            copy->value.bignum.digits = (uint32_t*)(IMAGE_BASE + extra);
+            break;
+        case VECTOR:
+            for (size_t i = 0; i < vector_length(obj); i++)
+                vector_elements(copy)[i] = image_pointer(w, vector_elements(obj)[i]);
+            break;
+        case HASHTABLE: {
+            HashTable *table = (HashTable*)data;
+            HashEntry *entries = (HashEntry*)(data + sizeof(HashTable));
+            *table = *obj->value.hash_table;
+            for (size_t i = 0; i < table->size; i++) {
+                entries[i] = obj->value.hash_table->entries[i];
+                entries[i].key = image_pointer(w, entries[i].key);
+                entries[i].value = image_pointer(w, entries[i].value);
+            }
+            table->entries = (HashEntry*)(IMAGE_BASE + extra + sizeof(HashTable));
+            copy->value.hash_table = (HashTable*)(IMAGE_BASE + extra);
+            break;
+        }
+        case NATIVE:
+            return 0;
+        case PORT: {
+            OutputPort *port = (OutputPort*)data;
+            memcpy(data + sizeof(OutputPort), obj->value.port->buffer, obj->value.port->length);
+            port->file = NULL;
+            port->buffer = (char*)(IMAGE_BASE + extra + sizeof(OutputPort));
+            port->length = port->capacity = obj->value.port->length;
+            copy->value.port = (OutputPort*)(IMAGE_BASE + extra);
+            break;
+        }
+        default:
+            break;
+    }
+    return 1;
+}
+
+// (dump-image "file")
+Object *dump_image(int argc, Object **argv)
 {
-    if (is_symbol(cadr(expr))) {
-        return cadr(expr);
+    Object *path = string_argument(argv[0], "dump-image");
+    if (!path)
+        return nill;
+    char *name = malloc(path->value.string.length + 1);
+    memcpy(name, path->value.string.chars, path->value.string.length);
+    name[path->value.string.length] = '\0';
+
+    ImageWriter w = {0};
+    image_collect(&w, the_global_environment);
+    w.map_size = 1;
+    while (w.map_size < 2 * w.count)
+        w.map_size *= 2;
+    w.keys = calloc(w.map_size, sizeof(Object*));
+    w.offsets = malloc(w.map_size * sizeof(uint64_t));
+    uint64_t size = sizeof(ImageHeader);
+    for (size_t i = 0; i < w.count; i++) {
+        size_t slot = image_map_index(&w, w.objects[i]);
+        w.keys[slot] = w.objects[i];
+        w.offsets[slot] = size;
+        size += object_cells(w.objects[i]) * sizeof(Object) + image_extra_bytes(w.objects[i]);
+    }
+    uint64_t objects_at = size;
+    size += w.count * sizeof(uint64_t);
+
+    w.buffer = calloc(1, size);
+    ImageHeader *header = (ImageHeader*)w.buffer;
+    memcpy(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+    header->size = size;
+    header->signature = image_signature();
+    header->global_environment = (uintptr_t)image_pointer(&w, the_global_environment);
+    header->object_count = w.count;
+    header->objects = objects_at;
+    uint64_t *offsets = (uint64_t*)(w.buffer + objects_at);
+    char written = 1;
+    for (size_t i = 0; i < w.count && written; i++) {
+        offsets[i] = image_offset(&w, w.objects[i]);
+        written = image_write_object(&w, w.objects[i], offsets[i]);
+    }
+    if (!written) {
+        report_error("dump-image: cannot save native code or an unknown analyzer node.");
     }
     else {
-        return caadr(expr);
+        FILE *file = fopen(name, "wb");
+        if (!file || fwrite(w.buffer, 1, size, file) != size || fclose(file) != 0)
+            report_error("dump-image: cannot write %s.", name);
     }
+    free(w.buffer);
+    free(w.keys);
+    free(w.offsets);
+    free(w.objects);
+    free(name);
+    return nill;
 }
 
-Object *definition_value(Object *expr)
+// ..........Loading
+static inline void relocate(Object **slot, ptrdiff_t delta)
 {
-    if (is_symbol(cadr(expr))) {
-        return caddr(expr);
+    if (*slot && is_heap_object(*slot))
+        *slot = (Object*)((char*)*slot + delta);
+}
+
+// Moves the pointers in obj and in what it owns by delta, except those
+// load_image rebuilds or fixes once every object is in place.
+void relocate_object(Object *obj, ptrdiff_t delta)
+{
+    switch (obj->type) {
+        case CLOSURE:
+            relocate(&obj->value.closure.lambda, delta);
+            relocate(&obj->value.closure.env, delta);
+            break;
+        case STRING:
+            obj->value.string.chars += delta;
+            if (string_base(obj) != obj)
+                relocate((Object**)(obj + 1), delta);
+            break;
+        case SYMBOL:
+            obj->value.symbol += delta;
+            break;
+        case PAIR:
+            relocate(&obj->value.pair.car, delta);
+            relocate(&obj->value.pair.cdr, delta);
+            break;
+        case LOCAL_REF:
+            relocate(&obj->value.ref.name, delta);
+            break;
+        case GLOBAL_REF:
+            relocate(&obj->value.global_ref.name, delta);
+            relocate(&obj->value.global_ref.binding, delta);
+            break;
+        case FRAME:
+            // the slots wait until the names list can be walked
+            relocate(&obj->value.frame.parent, delta);
+            relocate(&obj->value.frame.names, delta);
+            break;
+        case CODE: {
+            Bytecode *bc = (Bytecode*)((char*)obj->value.bytecode + delta);
+            obj->value.bytecode = bc;
+            bc->code = (int*)((char*)bc->code + delta);
+            bc->constants = (Object**)((char*)bc->constants + delta);
+            for (int i = 0; i < bc->nconstants; i++)
+                relocate(&bc->constants[i], delta);
+            relocate(&bc->names, delta);
+            relocate(&bc->name, delta);
+            break;
+        }
+        case NODE:
+            for (int i = 0; i < obj->value.node.count; i++)
+                relocate(&node_parts(obj)[i], delta);
+            break;
+        case BIGNUM:
+            obj->value.bignum.digits = (uint32_t*)((char*)obj->value.bignum.digits + delta);
+            break;
+        case VECTOR:
+            for (size_t i = 0; i < vector_length(obj); i++)
+                relocate(&vector_elements(obj)[i], delta);
+            break;
+        default:
+            break;
     }
-    else {
-        return make_lambda(cdadr(expr), cddr(expr));
+}
+
+// The tables hash by address, so they are built afresh, in malloced memory
+// like any other, from the entries in the image.
+// Returns the table or port it mallocs for obj, if any.
+void *rebuild_tables(Object *obj, ptrdiff_t delta)
+{
+    if (obj->type == GLOBAL_ENV) {
+        BindingTable *from = (BindingTable*)((char*)obj->value.table + delta);
+        Object **bindings = (Object**)((char*)from->bindings + delta);
+        BindingTable *table = malloc(sizeof(BindingTable));
+        table->size = from->size;
+        table->count = from->count;
+        table->bindings = calloc(table->size, sizeof(Object*));
+        for (size_t i = 0; i < table->size; i++) {
+            if (bindings[i]) {
+                relocate(&bindings[i], delta);
+                *table_slot(table, car(bindings[i])) = bindings[i];
+            }
+        }
+        obj->value.table = table;
+        return table;
+    }
+    if (obj->type == HASHTABLE) {
+        HashTable *from = (HashTable*)((char*)obj->value.hash_table + delta);
+        HashEntry *entries = (HashEntry*)((char*)from->entries + delta);
+        HashTable *table = malloc(sizeof(HashTable));
+        table->size = from->size;
+        table->count = 0;
+        table->entries = calloc(table->size, sizeof(HashEntry));
+        for (size_t i = 0; i < from->size; i++) {
+            if (entries[i].key) {
+                relocate(&entries[i].key, delta);
+                relocate(&entries[i].value, delta);
+                hash_table_put(table, entries[i].key, entries[i].value);
+            }
+        }
+        obj->value.hash_table = table;
+        return table;
+    }
+    if (obj->type == PORT) {
+        OutputPort *from = (OutputPort*)((char*)obj->value.port + delta);
+        obj->value.port = new_output_port(NULL);
+        port_write(obj->value.port, from->buffer + delta, from->length);
+        return obj->value.port;
     }
+    return NULL;
 }
 
-char is_self_evaluating(Object *expr) 
+// Maps the image at path in and returns its global environment, or NULL
+// after saying why not. Runs before anything is interned.
+Object *load_image(const char *path)
 {
-    return is_number(expr) || is_string(expr) || is_nill(expr);
+    FILE *file = fopen(path, "rb");
+    long size = file && fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (size < (long)sizeof(ImageHeader)) {
+        fprintf(stderr, "cannot read heap image %s\n", path);
+        if (file)
+            fclose(file);
+        return NULL;
+    }
+    char *base = mmap((void*)IMAGE_BASE, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    ImageHeader *header = (ImageHeader*)base;
+    if (base == MAP_FAILED || memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0
+            || header->size != (uint64_t)size || header->signature != image_signature()
+            || header->objects + header->object_count * sizeof(uint64_t) > header->size) {
+        fprintf(stderr, "%s is not a heap image written by this binary\n", path);
+        return NULL;
+    }
+    ptrdiff_t delta = base - (char*)IMAGE_BASE;
+    uint64_t *offsets = (uint64_t*)(base + header->objects);
+    image_objects = (Object**)offsets;
+    image_object_count = header->object_count;
+    for (size_t i = 0; i < image_object_count; i++) {
+        Object *obj = image_objects[i] = (Object*)(base + offsets[i]);
+        if (delta)
+            relocate_object(obj, delta);
+        if (obj->type == PRIMITIVE)
+            obj->value.primitive = &builtins[(uintptr_t)obj->value.primitive];
+        else if (obj->type == NODE)
+            obj->value.node.execute = node_executors[(uintptr_t)obj->value.node.execute];
+        else if (obj->type == SYMBOL)
+            insert_symbol(obj);
+    }
+    image_tables = malloc(image_object_count * sizeof(void*));
+    for (size_t i = 0; i < image_object_count; i++) {
+        Object *obj = image_objects[i];
+        if (obj->type == FRAME && delta) {
+            Object **slots = frame_slots(obj);
+            for (Object *n = obj->value.frame.names; is_pair(n); n = cdr(n))
+                relocate(slots++, delta);
+        }
+        void *table = rebuild_tables(obj, delta);
+        if (table)
+            image_tables[image_table_count++] = table;
+    }
+    return (Object*)((char*)(uintptr_t)header->global_environment + delta);
 }
 
-char is_application(Object *expr) 
+// ..............................Compiling to C................................
+// c_scheme --compile prog.scm -o prog.c translates a program to C, which
+// builds against c_scheme.h and the runtime library (make lib) into an
+// executable that runs the program:
+//   cc -O2 -I. prog.c libc_scheme.a -lm -o prog
+// Each lambda becomes a C function, see NativeLambda in c_scheme.h, and
+// procedures made from it are CLOSUREs with a NATIVE template, so compiled
+// and interpreted procedures call each other like any two modes do.
+// A variable lives in a C local unless a lambda inside the one binding it
+// refers to it. Those captured variables alone go in the FRAME a call
+// makes, which closures of the inner lambdas hold on to. Globals are read
+// through their binding, calls to the globals in inline_primitives go
+// through the native_ helpers, and literals are read back at startup from
+// their written form.
+//
+// Other calls nest on the C stack, checked as in call_analyzed. A call in
+// tail position returns to call_native, which runs it in the same C frame,
+// and a procedure calling itself in tail position jumps back to its top.
+
+// Calls the procedure under argc arguments on eval_stack, popping all of
+// them, and keeps following tail calls out of native code until one
+// returns a value.
+Object *call_native(int argc)
 {
-    return is_pair(expr);
+    char here;
+    if ((size_t)(analyze_stack_base - &here) > analyze_stack_limit) {
+        report_error("Recursion too deep.");
+        eval_sp -= argc + 1;
+        return nill;
+    }
+    char profiled = 0; // whether the running procedure has a profile frame
+    while (1) {
+        Object *proc = eval_stack[eval_sp - argc - 1];
+        if (!is_native_procedure(proc)) {
+            if (profiled)
+                profile_exit();
+            return call_procedure(argc);
+        }
+        const NativeLambda *lambda = closure_lambda(proc)->value.native.lambda;
+        if (argc != lambda->arity && !check_application(proc, argc)) {
+            if (profiled)
+                profile_exit();
+            eval_sp -= argc + 1;
+            return nill;
+        }
+        applications++;
+        // a tail call replaces its caller's profile frame
+        if (profiled)
+            profile_exit();
+        profiled = profiling;
+        if (profiled)
+            profile_enter(closure_name(proc));
+        size_t frame = eval_sp - argc - 1;
+        Object *val = lambda->function(proc, argc);
+        if (val != tail_call) {
+            if (profiled)
+                profile_exit();
+            eval_sp = frame;
+            return val;
+        }
+        // the tail call's procedure and arguments take the place of ours
+        argc = tail_call_argc;
+        memmove(eval_stack + frame, eval_stack + eval_sp - argc - 1, (argc + 1) * sizeof(Object*));
+        eval_sp = frame + argc + 1;
+    }
 }
 
-char is_last_exp(Object *expr_seq) 
+// The ordinary call the native_ helpers fall back on: whatever the global
+// bound by binding holds, applied to a, and to b when argc is 2.
+Object *call_global(Object *binding, int argc, Object *a, Object *b)
 {
-    return is_pair(expr_seq) && is_nill(cdr(expr_seq));
+    save(binding_value(binding));
+    save(a);
+    if (argc == 2)
+        save(b);
+    return call_procedure(argc);
 }
 
-char is_if(Object *expr)
+// A rest parameter's list of the count arguments from eval_stack[from] on.
+Object *native_rest(size_t from, int count)
 {
-    return is_tagged_list(&if_sym, expr);
+    Object *rest = nill;
+    PROTECT(rest);
+    for (int i = count - 1; i >= 0; i--)
+        rest = cons(eval_stack[from + i], rest);
+    UNPROTECT(1);
+    return rest;
 }
 
-Object *if_test(Object *expr) 
+// A literal of a compiled program from its written form. The program keeps
+// it in a static registered as a root.
+Object *read_constant(const char *text, size_t length)
 {
-    return cadr(expr);
+    Reader reader;
+    init_text_reader(&reader, text, length);
+    Object *datum = read(&reader);
+    free_reader(&reader);
+    return datum;
 }
 
-Object *if_consequent(Object *expr) 
+// ..........Code generation
+// The generated program is assembled from three buffers: declarations of
+// every static, the C functions of the lambdas in the order they were
+// finished, inner ones first, and the setup at the start of run_module that
+// fills in the statics before the top-level forms run.
+typedef struct CCompiler {
+    OutputPort *declarations;
+    OutputPort *functions;
+    OutputPort *setup;
+    int lambdas;
+    int constants;
+    Object **globals; // symbols, which never move or die, by static number
+    int global_count;
+    int global_capacity;
+} CCompiler;
+
+// A lambda being compiled, or the top level, which binds nothing. vars are
+// the parameters followed by the names defined at the top of the body, as
+// in frame_variables. The required parameters are read from eval_stack,
+// where the arguments stay, and written back there when assigned, so they
+// need no PROTECT; a rest parameter and the definitions are PROTECTed
+// locals. A captured variable has a slot in the scope's FRAME instead.
+typedef struct CScope {
+    struct CScope *outer;
+    Object **vars;
+    char *read;      // whether a variable's C local is read
+    int *slots;      // FRAME slot of a captured variable, -1 otherwise
+    int count;
+    int required;
+    int params;      // required, plus one for a rest parameter
+    int arity;
+    int frame_size;
+    int roots;       // PROTECTed locals, the FRAME among them
+    Object *name;    // the variable the lambda is defined as, () if none
+    char toplevel;
+    char uses_env;
+    char loops;      // has a self tail call jumping back to top
+    int id;
+    char *function;  // C name
+    OutputPort *body;
+    int indent;
+    int temps;
+} CScope;
+
+// A compiled subexpression: C text for its value, valid once the statements
+// emitted for it have run. Pure text, of a constant, variable or temporary,
+// cannot run code or allocate, so it may be used later. Other text must be
+// used before anything else is emitted, since it may call and allocate.
+typedef struct CValue {
+    char *text;
+    char pure;
+} CValue;
+
+CValue c_value(CCompiler *c, CScope *s, Object *expr);
+void c_tail(CCompiler *c, CScope *s, Object *expr);
+
+// The malloced text format gives, and its length. Without nonnull, gcc
+// with -fsanitize=undefined warns of a null format on the sizing call.
+#ifdef __GNUC__
+__attribute__((nonnull(2)))
+#endif
+char *c_vformat(int *length, const char *format, va_list args)
 {
-    return caddr(expr);
+    va_list sizing;
+    va_copy(sizing, args);
+    *length = vsnprintf(NULL, 0, format, sizing);
+    va_end(sizing);
+    char *text = malloc(*length + 1);
+    vsnprintf(text, *length + 1, format, args);
+    return text;
 }
 
-Object *if_subsequent(Object *expr) 
+char *c_format(const char *format, ...)
 {
-    if (!is_nill(cadddr(expr)))
-        return cadddr(expr);
-    else
-        return &false_sym;
+    int length;
+    va_list args;
+    va_start(args, format);
+    char *text = c_vformat(&length, format, args);
+    va_end(args);
+    return text;
 }
 
-char is_quoted(Object *expr)
+void c_vprint(OutputPort *port, const char *format, va_list args)
 {
-    return is_tagged_list(&quote_sym, expr);
+    int length;
+    char *text = c_vformat(&length, format, args);
+    port_write(port, text, length);
+    free(text);
 }
 
-Object *quotation_text(Object *expr)
+void c_print(OutputPort *port, const char *format, ...)
 {
-    return cadr(expr);
+    va_list args;
+    va_start(args, format);
+    c_vprint(port, format, args);
+    va_end(args);
 }
 
-// ....................................EVAL....................................
-Object *eval(Object *expr, Object *env);
-Object *eval_definition(Object *expr, Object *env);
-Object *eval_if(Object *expr, Object *env);
-Object *apply(Object *function, Object *arg_list);
+// One line of the body of the function s is compiling.
+void c_line(CScope *s, const char *format, ...)
+{
+    for (int i = 0; i < s->indent; i++)
+        port_puts(s->body, "    ");
+    va_list args;
+    va_start(args, format);
+    c_vprint(s->body, format, args);
+    va_end(args);
+    port_putc(s->body, '\n');
+}
+
+// name with everything but letters and digits made an underscore, to go
+// in a C identifier or comment.
+void c_put_identifier(OutputPort *port, const char *name)
+{
+    for (; *name; name++)
+        port_putc(port, isalnum((unsigned char)*name) ? *name : '_');
+}
 
-Object *eval_sequence(Object *expr_seq, Object *env)
+// chars as a C string literal, escaped so that it survives any compiler.
+char *c_quote(const char *chars, size_t length)
 {
-    if (is_last_exp(expr_seq)) {
-        return eval(car(expr_seq), env);
+    OutputPort *port = new_output_port(NULL);
+    port_putc(port, '"');
+    for (size_t i = 0; i < length; i++) {
+        unsigned char ch = chars[i];
+        if (ch == '"' || ch == '\\' || ch == '?')
+            c_print(port, "\\%c", ch);
+        else if (ch < ' ' || ch > '~')
+            c_print(port, "\\%03o", ch);
+        else
+            port_putc(port, ch);
     }
-    else {
-        eval(car(expr_seq), env); // for side-effects
-        return eval_sequence(cdr(expr_seq), env);
+    port_putc(port, '"');
+    port_putc(port, '\0');
+    char *text = port->buffer;
+    free(port);
+    return text;
+}
+
+static inline CValue c_pure(char *text)
+{
+    return (CValue){text, 1};
+}
+
+static inline CValue c_impure(char *text)
+{
+    return (CValue){text, 0};
+}
+
+// Evaluates v into a temporary now, so its text becomes pure.
+CValue c_materialize(CScope *s, CValue v)
+{
+    if (v.pure)
+        return v;
+    int t = s->temps++;
+    c_line(s, "Object *t%d = %s;", t, v.text);
+    free(v.text);
+    return c_pure(c_format("t%d", t));
+}
+
+// A static holding the literal whose written form is text.
+CValue c_constant(CCompiler *c, const char *text, size_t length)
+{
+    int n = c->constants++;
+    char *quoted = c_quote(text, length);
+    c_print(c->declarations, "static Object *constant_%d;\n", n);
+    c_print(c->setup, "    constant_%d = read_constant(%s, %zu);\n", n, quoted, length);
+    c_print(c->setup, "    gc_protect(&constant_%d);\n", n);
+    free(quoted);
+    return c_pure(c_format("constant_%d", n));
+}
+
+CValue c_literal(CCompiler *c, Object *datum)
+{
+    if (is_fixnum(datum))
+        return c_pure(c_format("new_int(%ld)", fixnum_value(datum)));
+    if (is_char(datum))
+        return c_pure(c_format("new_char(%d)", char_value(datum)));
+    if (datum == true_obj || datum == false_obj || datum == nill)
+        return c_pure(c_format("%s", datum == true_obj ? "true_obj" : datum == nill ? "nill" : "false_obj"));
+    OutputPort *port = new_output_port(NULL);
+    print_object(port, datum, 1);
+    CValue v = c_constant(c, port->buffer, port->length);
+    free_output_port(port);
+    return v;
+}
+
+// The static holding name's global binding.
+char *c_global(CCompiler *c, Object *name)
+{
+    int n = 0;
+    while (n < c->global_count && c->globals[n] != name)
+        n++;
+    if (n == c->global_count) {
+        if (c->global_count == c->global_capacity) {
+            c->global_capacity = c->global_capacity ? 2 * c->global_capacity : 64;
+            c->globals = realloc(c->globals, c->global_capacity * sizeof(Object*));
+        }
+        c->globals[c->global_count++] = name;
+        char *quoted = c_quote(name->value.symbol, strlen(name->value.symbol));
+        // the quoted name as a comment, with any "*/" broken up
+        c_print(c->declarations, "static Object *global_%d; /* ", n);
+        for (char *p = quoted; *p; p++) {
+            port_putc(c->declarations, *p);
+            if (p[0] == '*' && p[1] == '/')
+                port_putc(c->declarations, ' ');
+        }
+        port_puts(c->declarations, " */\n");
+        c_print(c->setup, "    global_%d = global_cell(intern(%s));\n", n, quoted);
+        free(quoted);
     }
+    return c_format("global_%d", n);
 }
 
-Object *eval(Object *expr, Object *env) 
+// The scope binding name, innermost first, with name's index in its vars
+// and the number of FRAMEs between, or NULL for a global.
+CScope *c_lookup(CScope *s, Object *name, int *index, int *depth)
 {
-    if (is_self_evaluating(expr))
-        return expr;
-    if (is_quoted(expr))
-        return quotation_text(expr);
-    else if (is_symbol(expr))
-        return lookup_variable(expr, env);
-    else if (is_if(expr))
-        return eval_if(expr, env);
-    else if (is_lambda(expr)) {
-        Object *params = lambda_params(expr);
-        Object *body = lambda_body(expr);
-        return make_compound_procedure(params, body, env);
+    *depth = 0;
+    for (; s; s = s->outer) {
+        for (int i = 0; i < s->count; i++) {
+            if (s->vars[i] == name) {
+                *index = i;
+                return s;
+            }
+        }
+        if (s->frame_size > 0)
+            (*depth)++;
     }
-    else if (is_definition(expr)) {
-        return eval_definition(expr, env);
+    return NULL;
+}
+
+// The environment closures made in s close over.
+char *c_environment(CScope *s)
+{
+    if (s->frame_size > 0)
+        return "frame";
+    if (s->toplevel)
+        return "the_global_environment";
+    s->uses_env = 1;
+    return "env";
+}
+
+// The lvalue holding variable index of scope, seen from s.
+char *c_place(CScope *s, CScope *scope, int index, int depth)
+{
+    int slot = scope->slots[index];
+    if (slot < 0)
+        return c_format("v%d", index);
+    if (depth == 0)
+        return c_format("frame_slots(%s)[%d]", c_environment(s), slot);
+    return c_format("native_slots(%s, %d)[%d]", c_environment(s), depth, slot);
+}
+
+CValue c_reference(CCompiler *c, CScope *s, Object *name)
+{
+    int index, depth;
+    CScope *scope = c_lookup(s, name, &index, &depth);
+    if (!scope) {
+        char *global = c_global(c, name);
+        CValue v = c_pure(c_format("binding_value(%s)", global));
+        free(global);
+        return v;
     }
-    else if (is_application(expr)) {
-        Object *evalled_pair = map_in_env(eval, expr, env);
-        Object *fun = car(evalled_pair);
-        Object *arg_list = cdr(evalled_pair);
-        return apply(fun, arg_list);
+    if (scope->slots[index] < 0)
+        scope->read[index] = 1;
+    char *place = c_place(s, scope, index, depth);
+    if (index < scope->params)
+        return c_pure(place);
+    // a definition may not have run yet
+    char *quoted = c_quote(name->value.symbol, strlen(name->value.symbol));
+    CValue v = c_pure(c_format("native_defined(%s, %s)", place, quoted));
+    free(quoted);
+    free(place);
+    return v;
+}
+
+// Emits the statement storing v in name, which define binds at the top
+// level and set! assigns anywhere else.
+void c_assign(CCompiler *c, CScope *s, Object *name, CValue v, char define)
+{
+    int index, depth;
+    CScope *scope = c_lookup(s, name, &index, &depth);
+    if (!scope) {
+        char *global = c_global(c, name);
+        c_line(s, define ? "set_cdr(%s, %s);" : "set_global(%s, %s);", global, v.text);
+        free(global);
+    }
+    else if (scope->slots[index] < 0 && index < scope->required) {
+        // the argument on eval_stack keeps the new value alive; call first,
+        // since a call may move eval_stack
+        v = c_materialize(s, v);
+        c_line(s, "v%d = eval_stack[base + %d] = %s;", index, index, v.text);
     }
     else {
-        printf("I don't know how to evaluate this expr");
-        return nill;
+        char *place = c_place(s, scope, index, depth);
+        c_line(s, "%s = %s;", place, v.text);
+        free(place);
     }
+    free(v.text);
 }
 
-Object *eval_definition(Object *expr, Object *env)
+// The parameters and body of the lambda a definition binds, if it does.
+// The (define (name . params) body) form is taken apart as it is, without
+// consing up the lambda.
+char c_definition_lambda(Object *expr, Object **params, Object **body)
 {
-    Object *var = definition_variable(expr);
-    Object *val = eval(definition_value(expr), env);
-    define_variable(var, val, env);
-    return nill;
+    if (is_pair(cadr(expr))) {
+        *params = cdadr(expr);
+        *body = cddr(expr);
+        return 1;
+    }
+    if (is_lambda(caddr(expr))) {
+        *params = lambda_params(caddr(expr));
+        *body = lambda_body(caddr(expr));
+        return 1;
+    }
+    return 0;
 }
 
-Object *eval_if(Object *expr, Object *env)
+// Names bound by the lambdas around a reference, innermost last.
+typedef struct CNames {
+    Object **names;
+    int count;
+    int capacity;
+} CNames;
+
+void c_add_name(CNames *names, Object *name)
 {
-    Object *test = if_test(expr);
-    Object *consq = if_consequent(expr);
-    Object *subsq = if_subsequent(expr);
-    if (eq(eval(if_test(expr), env), &true_sym))
-        return eval(consq, env);
-    else
-        return eval(subsq, env);
+    for (int i = 0; i < names->count; i++) {
+        if (names->names[i] == name)
+            return;
+    }
+    if (names->count == names->capacity) {
+        names->capacity = names->capacity ? 2 * names->capacity : 16;
+        names->names = realloc(names->names, names->capacity * sizeof(Object*));
+    }
+    names->names[names->count++] = name;
+}
+
+// Parameters, then the names defined at the top of body, each once.
+// Returns the number of required parameters and sets *rest.
+int c_lambda_variables(CNames *vars, Object *params, Object *body, char *rest)
+{
+    int required = 0;
+    for (; is_pair(params); params = cdr(params), required++)
+        c_add_name(vars, car(params));
+    *rest = is_symbol(params);
+    if (*rest)
+        c_add_name(vars, params);
+    for (; is_pair(body); body = cdr(body)) {
+        if (is_definition(car(body)))
+            c_add_name(vars, definition_variable(car(body)));
+    }
+    return required;
 }
 
+void c_find_captures(CScope *s, Object *expr, CNames *inner, int nesting);
+
+void c_find_captures_in_lambda(CScope *s, Object *params, Object *body, CNames *inner,
+        int nesting)
+{
+    // names the lambda binds hide those of s until it ends, unless inner
+    // binds them already, so drop only what this lambda added
+    int mark = inner->count;
+    char rest;
+    c_lambda_variables(inner, params, body, &rest);
+    for (; is_pair(body); body = cdr(body))
+        c_find_captures(s, car(body), inner, nesting + 1);
+    inner->count = mark;
+}
 
-Object *apply(Object *function, Object *arg_list)
+// Marks the variables of s that lambdas inside expr refer to. inner holds
+// the names bound between s and expr.
+void c_find_captures(CScope *s, Object *expr, CNames *inner, int nesting)
 {
-    if (is_primitive_procedure(function)) {
-        return primitive_procedure(function)->value.function(arg_list);
+    if (is_symbol(expr)) {
+        if (nesting == 0)
+            return;
+        for (int i = 0; i < inner->count; i++) {
+            if (inner->names[i] == expr)
+                return;
+        }
+        for (int i = 0; i < s->count; i++) {
+            if (s->vars[i] == expr)
+                s->slots[i] = 0;
+        }
+        return;
+    }
+    if (is_atom(expr) || is_quoted(expr))
+        return;
+    Object *params, *body;
+    if (is_lambda(expr)) {
+        c_find_captures_in_lambda(s, lambda_params(expr), lambda_body(expr), inner, nesting);
     }
-    else if (is_compound_procedure(function)) {
-        Object *proc_env = procedure_environment(function);
-        Object *params = procedure_params(function);
-        Object *new_env = extend_environment(params, arg_list, proc_env);
-        Object *body = procedure_body(function);
-        return eval_sequence(body, new_env);
+    else if (is_definition(expr)) {
+        c_find_captures(s, definition_variable(expr), inner, nesting);
+        if (c_definition_lambda(expr, &params, &body))
+            c_find_captures_in_lambda(s, params, body, inner, nesting);
+        else
+            c_find_captures(s, caddr(expr), inner, nesting);
     }
     else {
-        printf("ERROR: First element is not a procedure.\n");
-        return nill;
+        // if, set! and applications: every element may refer to variables,
+        // and the keywords themselves are not variables of s
+        for (; is_pair(expr); expr = cdr(expr))
+            c_find_captures(s, car(expr), inner, nesting);
     }
-    
 }
 
-// ....................................PRINT...................................
-void display(Object *expr);
-
-void display_pair(Object *expr) {
-    Object *head = car(expr);
-    Object *tail = cdr(expr);
-    printf("%c", '(');
-    while ((!is_atom(tail)) && !is_nill(tail)) {
-        display(head);
-        printf("%c", ' ');
-        head = car(tail);
-        tail = cdr(tail);
-    }
-    if (is_nill(tail)) {
-        display(head);
-        printf("%c", ')');
+// The global an application of op to argc arguments calls inline, as an
+// index into inline_primitives, or -1.
+int c_inline_primitive(CScope *s, Object *op, int argc)
+{
+    int index, depth;
+    if (!is_symbol(op) || c_lookup(s, op, &index, &depth))
+        return -1;
+    for (int i = 0; i < NUM_INLINE_PRIMITIVES; i++) {
+        if (inline_primitives[i].argc == argc && op == intern(inline_primitives[i].name))
+            return i;
+    }
+    return -1;
+}
+
+// Expressions whose values are pure text, compiled without statements.
+char c_is_simple(Object *expr)
+{
+    return is_symbol(expr) || is_self_evaluating(expr) || is_quoted(expr);
+}
+
+CValue c_inline(CCompiler *c, CScope *s, int primitive, Object *args)
+{
+    char *helper = inline_primitives[primitive].helper;
+    char *global = c_global(c, intern(inline_primitives[primitive].name));
+    CValue a = c_value(c, s, car(args));
+    CValue result;
+    if (is_nill(cdr(args))) {
+        result = c_impure(c_format("%s(%s, %s)", helper, global, a.text));
+    }
+    else if (c_is_simple(cadr(args))) {
+        CValue b = c_value(c, s, cadr(args));
+        result = c_impure(c_format("%s(%s, %s, %s)", helper, global, a.text, b.text));
+        free(b.text);
     }
     else {
-        display(head);
-        printf("%s", " . ");
-        display(tail);
-        printf("%c", ')');
+        // a stays on eval_stack while b runs
+        c_line(s, "save(%s);", a.text);
+        CValue b = c_materialize(s, c_value(c, s, cadr(args)));
+        int t = s->temps++;
+        c_line(s, "Object *t%d = restore();", t);
+        result = c_impure(c_format("%s(%s, t%d, %s)", helper, global, t, b.text));
+        free(b.text);
     }
+    free(a.text);
+    free(global);
+    return result;
 }
 
-void display(Object *expr) {
-    if (is_integer(expr)) {
-        printf("%ld", expr->value.integer);
+void c_return(CScope *s, CValue v)
+{
+    if (s->roots > 0) {
+        v = c_materialize(s, v);
+        c_line(s, "UNPROTECT(%d);", s->roots);
     }
-    else if (is_string(expr)) {
-        printf("%s", expr->value.string);
+    c_line(s, "return %s;", v.text);
+    free(v.text);
+}
+
+// A call pushes the procedure and its arguments as they are evaluated, so
+// they are roots from the start. In tail position it returns tail_call,
+// unless it turns out to call the running procedure with the arguments it
+// takes, which are then moved into place for the jump back to top. Text is
+// NULL when the call returned.
+CValue c_application(CCompiler *c, CScope *s, Object *expr, char tail)
+{
+    Object *op = car(expr);
+    int argc = list_length(cdr(expr));
+    int primitive = c_inline_primitive(s, op, argc);
+    if (primitive >= 0)
+        return c_inline(c, s, primitive, cdr(expr));
+    for (Object *x = expr; is_pair(x); x = cdr(x)) {
+        CValue v = c_value(c, s, car(x));
+        c_line(s, "save(%s);", v.text);
+        free(v.text);
     }
-    else if (is_symbol(expr)) {
-        printf("%s", expr->value.symbol);
+    if (!tail || s->toplevel)
+        return c_impure(c_format("call_native(%d)", argc));
+    if (op == s->name && argc == s->arity) {
+        // a profiled call must go through call_native to be counted
+        c_line(s, "if (eval_stack[eval_sp - %d] == self && !profiling) {", argc + 1);
+        for (int i = 0; i < argc; i++)
+            c_line(s, "    v%d = eval_stack[base + %d] = eval_stack[eval_sp - %d];", i, i, argc - i);
+        c_line(s, "    eval_sp = base + %d;", argc);
+        c_line(s, "    applications++;");
+        c_line(s, "    goto top;");
+        c_line(s, "}");
+        s->loops = 1;
     }
-    else if (is_pair(expr)) {
-        display_pair(expr);
+    c_line(s, "tail_call_argc = %d;", argc);
+    if (s->roots > 0)
+        c_line(s, "UNPROTECT(%d);", s->roots);
+    c_line(s, "return tail_call;");
+    return (CValue){NULL, 0};
+}
+
+CValue c_if(CCompiler *c, CScope *s, Object *expr, char tail)
+{
+    CValue test = c_value(c, s, if_test(expr));
+    int t = -1;
+    if (!tail) {
+        t = s->temps++;
+        c_line(s, "Object *t%d;", t);
     }
-    else if (is_nill(expr)) {
-        printf("()");
+    c_line(s, "if (%s != false_obj) {", test.text);
+    free(test.text);
+    for (int branch = 0; branch < 2; branch++) {
+        Object *arm = branch == 0 ? if_consequent(expr) : if_subsequent(expr);
+        s->indent++;
+        if (tail) {
+            c_tail(c, s, arm);
+        }
+        else {
+            CValue v = c_value(c, s, arm);
+            c_line(s, "t%d = %s;", t, v.text);
+            free(v.text);
+        }
+        s->indent--;
+        c_line(s, branch == 0 ? "} else {" : "}");
+    }
+    return tail ? (CValue){NULL, 0} : c_pure(c_format("t%d", t));
+}
+
+void c_effect(CCompiler *c, CScope *s, Object *expr)
+{
+    CValue v = c_value(c, s, expr);
+    if (!v.pure)
+        c_line(s, "%s;", v.text);
+    free(v.text);
+}
+
+void c_finish_lambda(CCompiler *c, CScope *s);
+
+// Compiles a lambda into a C function of its own and gives the text making
+// a closure over it in s.
+CValue c_lambda(CCompiler *c, CScope *s, Object *params, Object *body, Object *name)
+{
+    CNames vars = {0};
+    CScope inner = {0};
+    char rest;
+    inner.outer = s;
+    inner.required = c_lambda_variables(&vars, params, body, &rest);
+    inner.vars = vars.names;
+    inner.count = vars.count;
+    inner.params = inner.required + rest;
+    inner.arity = rest ? -inner.required - 1 : inner.required;
+    inner.name = name;
+    inner.id = c->lambdas++;
+    inner.read = calloc(inner.count + 1, 1);
+    inner.slots = malloc((inner.count + 1) * sizeof(int));
+    for (int i = 0; i < inner.count; i++)
+        inner.slots[i] = -1;
+
+    CNames hidden = {0};
+    for (Object *b = body; is_pair(b); b = cdr(b))
+        c_find_captures(&inner, car(b), &hidden, 0);
+    free(hidden.names);
+    for (int i = 0; i < inner.count; i++) {
+        if (inner.slots[i] == 0)
+            inner.slots[i] = inner.frame_size++;
+        else if (i >= inner.required)
+            inner.roots++;
+    }
+    if (rest && inner.slots[inner.required] >= 0)
+        inner.roots++; // held until it is in the frame
+    if (inner.frame_size > 0)
+        inner.roots++;
+
+    OutputPort *cname = new_output_port(NULL);
+    port_puts(cname, "scheme_");
+    c_put_identifier(cname, is_symbol(name) ? name->value.symbol : "lambda");
+    c_print(cname, "_%d", inner.id);
+    port_putc(cname, '\0');
+    inner.function = cname->buffer;
+    free(cname);
+
+    inner.body = new_output_port(NULL);
+    inner.indent = 1;
+    if (is_nill(body)) {
+        report_error("--compile: lambda with an empty body.");
     }
     else {
-        printf("I don't know how to display this yet :(");
+        for (; !is_last_exp(body); body = cdr(body))
+            c_effect(c, &inner, car(body));
+        c_tail(c, &inner, car(body));
+    }
+    c_finish_lambda(c, &inner);
+    CValue v = c_impure(c_format("new_closure(%s_template, %s)", inner.function,
+                c_environment(s)));
+    free(inner.function);
+    free(inner.vars);
+    free(inner.read);
+    free(inner.slots);
+    return v;
+}
+
+// Writes out the function s compiled, with the prologue its body turned out
+// to need, and its declarations and setup.
+void c_finish_lambda(CCompiler *c, CScope *s)
+{
+    OutputPort *out = c->functions;
+    char *fn = s->function;
+    char *name = is_symbol(s->name) ? c_quote(s->name->value.symbol, strlen(s->name->value.symbol))
+                                    : c_format("NULL");
+    c_print(c->declarations, "static Object *%s(Object *self, int argc);\n", fn);
+    c_print(c->declarations, "static const NativeLambda %s_lambda = {%s, %s, %d};\n", fn, name, fn,
+            s->arity);
+    c_print(c->declarations, "static Object *%s_template;\n", fn);
+    c_print(c->setup, "    %s_template = new_native(&%s_lambda);\n", fn, fn);
+    c_print(c->setup, "    gc_protect(&%s_template);\n", fn);
+    free(name);
+
+    if (s->frame_size > 0)
+        s->uses_env = 1; // the frame's parent
+    c_print(out, "\nstatic Object *%s(Object *self, int argc)\n{\n", fn);
+    if (s->params > 0 || s->loops)
+        c_print(out, "    size_t base = eval_sp - argc;\n");
+    for (int i = 0; i < s->required; i++) {
+        c_print(out, "    Object *v%d = eval_stack[base + %d];\n", i, i);
+        if (s->slots[i] < 0 && !s->read[i])
+            c_print(out, "    (void)v%d;\n", i);
+    }
+    if (s->params > s->required) {
+        c_print(out, "    Object *v%d = native_rest(base + %d, argc - %d);\n", s->required,
+                s->required, s->required);
+        c_print(out, "    PROTECT(v%d);\n", s->required);
+    }
+    for (int i = s->params; i < s->count; i++) {
+        if (s->slots[i] < 0) {
+            c_print(out, "    Object *v%d = unassigned;\n", i);
+            c_print(out, "    PROTECT(v%d);\n", i);
+        }
+    }
+    if (s->uses_env)
+        c_print(out, "    Object *env = self->value.closure.env;\n");
+    else if (!s->loops)
+        c_print(out, "    (void)self;\n");
+    if (s->params == 0 && !s->loops)
+        c_print(out, "    (void)argc;\n");
+    if (s->frame_size > 0) {
+        c_print(out, "    Object *frame = nill;\n");
+        c_print(out, "    PROTECT(frame);\n");
+    }
+    if (s->loops) {
+        c_print(out, "top:\n");
+        for (int i = s->params; i < s->count; i++) {
+            if (s->slots[i] < 0)
+                c_print(out, "    v%d = unassigned;\n", i);
+        }
+    }
+    if (s->frame_size > 0) {
+        // the names of the captured variables, for the collector and the
+        // printer, in slot order
+        OutputPort *names = new_output_port(NULL);
+        port_putc(names, '(');
+        for (int i = 0; i < s->count; i++) {
+            if (s->slots[i] >= 0) {
+                if (s->slots[i] > 0)
+                    port_putc(names, ' ');
+                port_puts(names, s->vars[i]->value.symbol);
+            }
+        }
+        port_putc(names, ')');
+        CValue list = c_constant(c, names->buffer, names->length);
+        free_output_port(names);
+        c_print(out, "    frame = new_frame(%s, %d, env);\n", list.text, s->frame_size);
+        for (int i = 0; i < s->params; i++) {
+            if (s->slots[i] >= 0)
+                c_print(out, "    frame_slots(frame)[%d] = v%d;\n", s->slots[i], i);
+        }
+        free(list.text);
+    }
+    port_write(out, s->body->buffer, s->body->length);
+    port_puts(out, "}\n");
+    free_output_port(s->body);
+}
+
+// Emits the statements that return expr's value, or make its tail call.
+void c_tail(CCompiler *c, CScope *s, Object *expr)
+{
+    CValue v;
+    if (is_if(expr))
+        v = c_if(c, s, expr, 1);
+    else if (is_application(expr) && !is_quoted(expr) && !is_lambda(expr)
+             && !is_definition(expr) && !is_assignment(expr))
+        v = c_application(c, s, expr, 1);
+    else
+        v = c_value(c, s, expr);
+    if (v.text)
+        c_return(s, v);
+}
+
+CValue c_value(CCompiler *c, CScope *s, Object *expr)
+{
+    if (is_symbol(expr))
+        return c_reference(c, s, expr);
+    if (is_self_evaluating(expr))
+        return c_literal(c, expr);
+    if (is_quoted(expr))
+        return c_literal(c, quotation_text(expr));
+    if (is_if(expr))
+        return c_if(c, s, expr, 0);
+    if (is_lambda(expr))
+        return c_lambda(c, s, lambda_params(expr), lambda_body(expr), nill);
+    if (is_definition(expr)) {
+        Object *name = definition_variable(expr);
+        int index, depth;
+        if (!s->toplevel && c_lookup(s, name, &index, &depth) != s) {
+            report_error("define of %s is not at the start of a body.", name->value.symbol);
+            return c_pure(c_format("nill"));
+        }
+        Object *params, *body;
+        CValue v;
+        if (c_definition_lambda(expr, &params, &body))
+            v = c_lambda(c, s, params, body, name);
+        else
+            v = c_value(c, s, caddr(expr));
+        c_assign(c, s, name, v, 1);
+        return c_pure(c_format("nill"));
+    }
+    if (is_assignment(expr)) {
+        c_assign(c, s, assignment_variable(expr), c_value(c, s, assignment_value(expr)), 0);
+        return c_pure(c_format("nill"));
+    }
+    if (is_application(expr))
+        return c_application(c, s, expr, 0);
+    report_error("I don't know how to compile this expr.");
+    return c_pure(c_format("nill"));
+}
+
+// A top-level form, stopping the program at the first one that reports an
+// error, like run_batch. (profile expr) works as in execute_toplevel.
+void c_toplevel(CCompiler *c, CScope *top, Object *expr)
+{
+    if (is_tagged_list(profile_sym, expr) && is_pair(cdr(expr))) {
+        int t = top->temps++;
+        c_line(top, "char t%d = profiling;", t);
+        c_line(top, "profiling = 1;");
+        c_toplevel(c, top, cadr(expr));
+        c_line(top, "if (!t%d) {", t);
+        c_line(top, "    profiling = 0;");
+        c_line(top, "    profile_finish();");
+        c_line(top, "}");
+        return;
+    }
+    c_effect(c, top, expr);
+    c_line(top, "if (error_count)");
+    c_line(top, "    return EXIT_FAILURE;");
+}
+
+// c_scheme --compile path [-o output]: writes the program in path as C to
+// output, or to stdout. Nothing is written if any form fails to compile.
+int compile_program(char *path, char *output_path)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "--compile: cannot open %s\n", path);
+        return EXIT_FAILURE;
+    }
+    error_output = stderr;
+    Reader reader;
+    init_file_reader(&reader, file);
+    Object *forms = nill;
+    Object *expr = nill;
+    PROTECT(forms);
+    PROTECT(expr);
+    while ((expr = read(&reader)) != eof_object)
+        forms = cons(expr, forms);
+    forms = reverse(forms);
+    free_reader(&reader);
+    if (file != stdin)
+        fclose(file);
+
+    CCompiler c = {0};
+    c.declarations = new_output_port(NULL);
+    c.functions = new_output_port(NULL);
+    c.setup = new_output_port(NULL);
+    CScope top = {0};
+    top.toplevel = 1;
+    top.body = new_output_port(NULL);
+    top.indent = 1;
+    for (Object *f = forms; is_pair(f) && error_count == 0; f = cdr(f))
+        c_toplevel(&c, &top, car(f));
+    UNPROTECT(2);
+
+    int status = EXIT_FAILURE;
+    FILE *out = NULL;
+    if (error_count == 0) {
+        out = output_path ? fopen(output_path, "w") : stdout;
+        if (!out)
+            fprintf(stderr, "--compile: cannot write %s\n", output_path);
+    }
+    if (out) {
+        fprintf(out, "// Compiled from %s by c_scheme --compile. Build with\n"
+                "//   cc -O2 -I<c_scheme dir> %s <c_scheme dir>/libc_scheme.a -lm\n"
+                "#include \"c_scheme.h\"\n\n", path, output_path ? output_path : "this.c");
+        fwrite(c.declarations->buffer, 1, c.declarations->length, out);
+        fwrite(c.functions->buffer, 1, c.functions->length, out);
+        fprintf(out, "\nstatic int run_module(void)\n{\n");
+        fwrite(c.setup->buffer, 1, c.setup->length, out);
+        fwrite(top.body->buffer, 1, top.body->length, out);
+        fprintf(out, "    return EXIT_SUCCESS;\n}\n\n"
+                "int main(int argc, char *argv[])\n{\n"
+                "    return scheme_main(argc, argv, run_module);\n}\n");
+        status = EXIT_SUCCESS;
+        if (out != stdout && fclose(out) != 0) {
+            fprintf(stderr, "--compile: cannot write %s\n", output_path);
+            status = EXIT_FAILURE;
+        }
     }
+    free_output_port(c.declarations);
+    free_output_port(c.functions);
+    free_output_port(c.setup);
+    free_output_port(top.body);
+    free(c.globals);
+    return status;
 }
 
 // ....................................LOOP....................................
+typedef enum ExecutionMode {MODE_EVAL, MODE_VM, MODE_ANALYZE} ExecutionMode;
+ExecutionMode execution_mode = MODE_EVAL;
 
-void init(void) {
-    nill = alloc_object(NILL);
+// Whether the heap image given with --image, if any, could be loaded.
+int init(void) {
+    error_output = stdout;
+    stdout_port = new_output_port(stdout);
+    atexit(flush_stdout_port);
+    command_line_arguments = nill;
     the_empty_environment = nill;
-    primitive_procedure_tag = new_symbol("primitive_procedure");
-    compound_procedure_tag = new_symbol("compound_procedure");
-    the_global_environment = load_builtins();
+    init_symbol_table();
+    Object *image = NULL;
+    if (image_path && !(image = load_image(image_path)))
+        return 0;
+    lambda_sym = intern("lambda");
+    if_sym = intern("if");
+    define_sym = intern("define");
+    quote_sym = intern("quote");
+    set_sym = intern("set!");
+    profile_sym = intern("profile");
+    the_global_environment = image ? image : load_builtins();
+    init_inline_primitives();
+    return 1;
 }
 
-int main(void) {
-    printf("Mini-scheme interpreter in C.\n");
-    printf("Ctrl-c to exit.\n");
-    char token_array[MAX_LINE_LEN][MAX_TOK_LEN];
-    char *line = NULL;
-    size_t max_len = 0;
-    size_t line_length;
-    size_t token_index = 0;
+Object *execute_toplevel(Object *expr)
+{
+    if (is_tagged_list(profile_sym, expr) && is_pair(cdr(expr))) {
+        // (profile expr) reports on just that expression, unless --profile
+        // is already collecting for the whole run
+        if (profiling)
+            return execute_toplevel(cadr(expr));
+        profiling = 1;
+        Object *value = execute_toplevel(cadr(expr));
+        profiling = 0;
+        PROTECT(value);
+        profile_finish();
+        UNPROTECT(1);
+        return value;
+    }
+    char base;
+    set_analyze_stack_base(&base);
+    PROTECT(expr);
+    expr = resolve(expr, nill);
+    Object *value;
+    if (execution_mode == MODE_VM)
+        value = vm_execute(expr);
+    else if (execution_mode == MODE_ANALYZE)
+        value = analyze_execute(expr);
+    else
+        value = eval(expr, the_global_environment);
+    UNPROTECT(1);
+    return value;
+}
+
+// Runs every datum from reader without prompts or echo, stopping at the
+// first one that reports an error.
+int run_batch(Reader *reader)
+{
+    Object *expr;
+    while ((expr = read(reader)) != eof_object && error_count == 0)
+        execute_toplevel(expr);
+    return error_count ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-    init();
+void repl(Reader *reader)
+{
+    char prompt[32];
+    port_puts(stdout_port, "Mini-scheme interpreter in C.\n");
+    port_puts(stdout_port, "Ctrl-c to exit.\n");
     int counter = 0;
     Object *expr;
     Object *value;
     while (1) {
-        token_index = 0;
-        printf("[In  %d]: ", counter);
-        line = NULL;
-        max_len = 0;
-        memset(token_array, 0, sizeof(token_array));
-        line_length = getline(&line, &max_len, stdin);
-        line[line_length-1] = '\0';
-        tokenize_string(line, token_array);
-        expr = read(token_array, &token_index);
-        value = eval(expr, the_global_environment);
-        printf("[Out %d]: ", counter);
-        display(value);
-        printf("\n");
+        port_write(stdout_port, prompt, sprintf(prompt, "[In  %d]: ", counter));
+        flush_stdout_port();
+        expr = read(reader);
+        if (expr == eof_object) {
+            port_puts(stdout_port, "Exiting.\n");
+            break;
+        }
+        value = execute_toplevel(expr);
+        port_write(stdout_port, prompt, sprintf(prompt, "[Out %d]: ", counter));
+        write_object(value);
+        newline();
         ++counter;
-        clearerr(stdin);
     }
-    return 0;
 }
+
+// The interpreter's main, and that of every program --compile writes, which
+// passes the function running its top-level forms as module. -e runs its
+// expression after the script or compiled program, if there is one and it
+// succeeds. A compiled program takes the same options, and its
+// (command-line) is its own name followed by the rest of the command line.
+int scheme_main(int argc, char *argv[], int (*module)(void))
+{
+    start_time = now_seconds();
+    char *expression = NULL;
+    char *compile_path = NULL;
+    char *output_path = NULL;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--heap-size") == 0 && i + 1 < argc) {
+            gc_heap_size = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--gc-stats") == 0) {
+            atexit(gc_report);
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            atexit(runtime_report);
+        }
+        else if (strcmp(argv[i], "--vm") == 0) {
+            execution_mode = MODE_VM;
+        }
+        else if (strcmp(argv[i], "--analyze") == 0) {
+            execution_mode = MODE_ANALYZE;
+        }
+        else if (strcmp(argv[i], "--profile") == 0) {
+            profiling = 1;
+        }
+        else if (strcmp(argv[i], "--profile-stacks") == 0 && i + 1 < argc) {
+            // the stacks come from the profile, so this turns it on too
+            profile_stacks_path = argv[++i];
+            profiling = 1;
+        }
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            expression = argv[++i];
+        }
+        else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc && !module) {
+            compile_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc && !module) {
+            output_path = argv[++i];
+        }
+        else {
+            fprintf(stderr, "usage: %s [--heap-size cells] [--gc-stats] [--stats] [--vm | --analyze]\n"
+                    "          [--profile] [--profile-stacks file] [--image file]\n"
+                    "          [-e expr] [script.scm [args] | - [args] | --compile file [-o file]]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (profiling)
+        atexit(profile_finish);
+
+    if (!init())
+        return EXIT_FAILURE;
+    if (compile_path)
+        return compile_program(compile_path, output_path);
+    Reader reader;
+    int status = EXIT_SUCCESS;
+    if (!module && !expression && i == argc) {
+        init_file_reader(&reader, stdin);
+        repl(&reader);
+        free_reader(&reader);
+        return status;
+    }
+    error_output = stderr;
+    if (module) {
+        for (int j = argc - 1; j >= i; j--)
+            command_line_arguments = cons(new_string(argv[j], strlen(argv[j])), command_line_arguments);
+        command_line_arguments = cons(new_string(argv[0], strlen(argv[0])), command_line_arguments);
+        char base;
+        set_analyze_stack_base(&base);
+        status = module();
+    }
+    else if (i < argc) {
+        // script.scm, or - for a script on stdin
+        FILE *script = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "r");
+        if (!script) {
+            fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[i]);
+            return EXIT_FAILURE;
+        }
+        for (int j = argc - 1; j >= i; j--)
+            command_line_arguments = cons(new_string(argv[j], strlen(argv[j])), command_line_arguments);
+        init_file_reader(&reader, script);
+        status = run_batch(&reader);
+        free_reader(&reader);
+        if (script != stdin)
+            fclose(script);
+    }
+    // -e runs after the program or script, against its definitions
+    if (expression && status == EXIT_SUCCESS) {
+        init_text_reader(&reader, expression, strlen(expression));
+        status = run_batch(&reader);
+        free_reader(&reader);
+    }
+    return status;
+}
+
+#ifndef C_SCHEME_LIBRARY
+int main(int argc, char *argv[])
+{
+    return scheme_main(argc, argv, NULL);
+}
+#endif
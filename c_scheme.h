@@ -0,0 +1,457 @@
+// The runtime's interface, shared by c_scheme.c and by the C that --compile
+// generates: the Object representation, GC roots, the evaluator stack and
+// the entry points compiled code calls. Built with -DC_SCHEME_LIBRARY,
+// c_scheme.c leaves out main and becomes the runtime library compiled
+// programs link against, see Compiling to C in c_scheme.c.
+#ifndef C_SCHEME_H
+#define C_SCHEME_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// ..................................Types....................................
+typedef enum Boolean {FALSE, TRUE} Boolean;
+
+typedef enum ObjectType {INT, CHAR, BOOLEAN, PRIMITIVE, CLOSURE, STRING, SYMBOL, PAIR, NILL,
+    LOCAL_REF, GLOBAL_REF, FRAME, GLOBAL_ENV, CODE, NODE, BIGNUM, FLONUM,
+    VECTOR, S64VECTOR, F64VECTOR, HASHTABLE, PORT, NATIVE, FREE} ObjectType;
+
+struct BindingTable;
+struct HashTable;
+struct OutputPort;
+struct Bytecode;
+struct Primitive;
+struct NativeLambda;
+
+typedef struct Object {
+    ObjectType type;
+    char marked;
+    unsigned short cells; // slab cells spanned, 0 if malloced on its own
+    union {
+        // followed in memory by its bytes, unless it is a substring sharing
+        // those of another string, see string_base
+        struct string {
+            char *chars;
+            uint32_t length;
+            uint32_t hash; // 0 until first used, see string_hash
+        } string;
+        char *symbol;
+        // a symbol's name, at the same offset as symbol, with its hash
+        // cached on first use, see text_hash
+        struct text {
+            char *chars;
+            unsigned long hash;
+        } text;
+        struct pair {
+            struct Object *car;
+            struct Object *cdr;
+        } pair;
+        const struct Primitive *primitive;
+        // a lambda template plus the environment it closes over
+        struct closure {
+            struct Object *lambda;
+            struct Object *env;
+        } closure;
+        struct ref {
+            struct Object *name;
+            int depth;
+            int index;
+        } ref;
+        // name at the same offset as in ref
+        struct global_ref {
+            struct Object *name;
+            struct Object *binding;
+        } global_ref;
+        // followed in memory by one value slot per name
+        struct frame {
+            struct Object *parent;
+            struct Object *names;
+        } frame;
+        struct BindingTable *table;
+        struct HashTable *hash_table;
+        struct OutputPort *port;
+        struct Bytecode *bytecode;
+        // a lambda compiled to C by --compile, see NativeLambda
+        struct native {
+            const struct NativeLambda *lambda;
+            struct Object *name;
+        } native;
+        // followed in memory by count part slots, like a frame
+        struct node {
+            struct Object* (*execute)(struct Object*, struct Object*);
+            int count;
+        } node;
+        struct bignum {
+            int sign;
+            int length;
+            uint32_t *digits;
+        } bignum;
+        double flonum;
+        // followed in memory by length 8-byte elements
+        struct vector {
+            size_t length;
+        } vector;
+    } value;
+} Object;
+
+// Fixnums, characters, booleans and () are immediates encoded in the Object*
+// word itself and never touch the heap. Heap objects are at least 8-byte
+// aligned, so the low bits of a real pointer are always 000:
+//   ...1    fixnum, value in the upper 63 bits
+//   ..010   character, value in the upper bits
+//   ..110   constant: (), #f, #t
+#define FIXNUM_TAG 0x1
+#define CHAR_TAG 0x2
+#define CONSTANT_TAG 0x6
+#define TAG_MASK 0x7
+#define CONSTANT(n) ((Object*)(((uintptr_t)(n) << 3) | CONSTANT_TAG))
+
+#define nill CONSTANT(0)
+#define false_obj CONSTANT(1)
+#define true_obj CONSTANT(2)
+#define unassigned CONSTANT(3) // frame slot of a definition not yet run
+#define tail_call CONSTANT(4) // an analyzed call in tail position, see Analyzer
+#define eof_object CONSTANT(5) // returned by read at the end of its input
+
+static inline char is_heap_object(Object *obj)
+{
+    return ((uintptr_t)obj & TAG_MASK) == 0;
+}
+
+static inline ObjectType type_of(Object *obj)
+{
+    uintptr_t bits = (uintptr_t)obj;
+    if ((bits & TAG_MASK) == 0)
+        return obj->type;
+    if (bits & FIXNUM_TAG)
+        return INT;
+    if ((bits & TAG_MASK) == CHAR_TAG)
+        return CHAR;
+    return obj == nill ? NILL : BOOLEAN;
+}
+
+// Cheaper than type_of when testing for one heap type.
+static inline char has_type(Object *obj, ObjectType type)
+{
+    return is_heap_object(obj) && obj->type == type;
+}
+
+static inline Object *new_int(long i)
+{
+    return (Object*)(((uintptr_t)i << 1) | FIXNUM_TAG);
+}
+
+static inline long fixnum_value(Object *obj)
+{
+    return (long)(intptr_t)obj >> 1;
+}
+
+static inline char is_fixnum(Object *obj)
+{
+    return ((uintptr_t)obj & FIXNUM_TAG) != 0;
+}
+
+static inline Object *new_char(char c)
+{
+    return (Object*)(((uintptr_t)(unsigned char)c << 3) | CHAR_TAG);
+}
+
+static inline char char_value(Object *obj)
+{
+    return (char)((uintptr_t)obj >> 3);
+}
+
+static inline Object *new_boolean(int b)
+{
+    return b ? true_obj : false_obj;
+}
+
+void report_error(const char *format, ...);
+Object *cons(Object *head, Object *tail);
+void set_cdr(Object *obj, Object *val);
+
+// ...............................Fixnums......................................
+#define FIXNUM_MAX (INTPTR_MAX >> 1)
+#define FIXNUM_MIN (INTPTR_MIN >> 1)
+
+// Fixnum arithmetic on the tagged words themselves: 2x+1 + 2y = 2(x+y)+1,
+// so the machine overflow flag is exactly fixnum overflow. These return 0
+// when the result does not fit.
+#ifdef __GNUC__
+static inline char fixnum_add(Object *a, Object *b, Object **result)
+{
+    intptr_t sum;
+    if (__builtin_add_overflow((intptr_t)a, (intptr_t)b - 1, &sum))
+        return 0;
+    *result = (Object*)sum;
+    return 1;
+}
+
+static inline char fixnum_sub(Object *a, Object *b, Object **result)
+{
+    intptr_t difference;
+    if (__builtin_sub_overflow((intptr_t)a, (intptr_t)b - 1, &difference))
+        return 0;
+    *result = (Object*)difference;
+    return 1;
+}
+
+static inline char fixnum_mul(Object *a, Object *b, Object **result)
+{
+    intptr_t product;
+    if (__builtin_mul_overflow(fixnum_value(a), (intptr_t)b - 1, &product))
+        return 0;
+    *result = (Object*)(product | FIXNUM_TAG);
+    return 1;
+}
+#else
+static inline char fixnum_fits(intptr_t x)
+{
+    return x >= FIXNUM_MIN && x <= FIXNUM_MAX;
+}
+
+static inline char fixnum_add(Object *a, Object *b, Object **result)
+{
+    intptr_t sum = fixnum_value(a) + fixnum_value(b);
+    *result = new_int(sum);
+    return fixnum_fits(sum);
+}
+
+static inline char fixnum_sub(Object *a, Object *b, Object **result)
+{
+    intptr_t difference = fixnum_value(a) - fixnum_value(b);
+    *result = new_int(difference);
+    return fixnum_fits(difference);
+}
+
+// Products that might be near the limit go the bignum way, which demotes
+// the result again if it fits after all.
+static inline char fixnum_mul(Object *a, Object *b, Object **result)
+{
+    intptr_t x = fixnum_value(a), y = fixnum_value(b);
+    double estimate = (double)x * (double)y;
+    if (estimate > FIXNUM_MAX / 2 || estimate < FIXNUM_MIN / 2)
+        return 0;
+    *result = new_int(x * y);
+    return 1;
+}
+#endif
+
+// ...........................Roots and the stack..............................
+// Any Object* held in a C local across a call that may allocate must be
+// registered with PROTECT and released with UNPROTECT. Values on eval_stack
+// are roots as they are.
+extern Object ***gc_roots;
+extern size_t gc_root_count;
+extern size_t gc_root_capacity;
+
+#define PROTECT(var) gc_protect(&(var))
+#define UNPROTECT(n) (gc_root_count -= (n))
+
+static inline void gc_protect(Object **root)
+{
+    if (gc_root_count == gc_root_capacity) {
+        gc_root_capacity = gc_root_capacity ? 2 * gc_root_capacity : 256;
+        gc_roots = realloc(gc_roots, gc_root_capacity * sizeof(Object**));
+    }
+    gc_roots[gc_root_count++] = root;
+}
+
+extern Object **eval_stack;
+extern size_t eval_sp;
+extern size_t eval_stack_capacity;
+extern size_t applications;
+extern int tail_call_argc;
+
+static inline void save(Object *obj)
+{
+    if (eval_sp == eval_stack_capacity) {
+        eval_stack_capacity = eval_stack_capacity ? 2 * eval_stack_capacity : 1024;
+        eval_stack = realloc(eval_stack, eval_stack_capacity * sizeof(Object*));
+    }
+    eval_stack[eval_sp++] = obj;
+}
+
+static inline Object *restore(void)
+{
+    return eval_stack[--eval_sp];
+}
+
+// ..............................Environments..................................
+extern Object *the_global_environment;
+
+// A frame holds one slot per name, starting in the cell after its header.
+static inline Object **frame_slots(Object *frame)
+{
+    return (Object**)(frame + 1);
+}
+
+static inline Object *binding_value(Object *binding)
+{
+    Object *value = binding->value.pair.cdr;
+    if (value == unassigned) {
+        report_error("%s not defined.", binding->value.pair.car->value.symbol);
+        return nill;
+    }
+    return value;
+}
+
+Object *global_cell(Object *name);
+void set_global(Object *binding, Object *value);
+Object *new_frame(Object *names, int size, Object *parent);
+Object *new_closure(Object *lambda, Object *env);
+Object *intern(char *name);
+
+// ...............................Native code..................................
+// A lambda compiled to C becomes a function of the closure being called and
+// the number of arguments, which are the top argc entries of eval_stack and
+// stay there, rooted, until call_native pops them. The function returns the
+// procedure's value, or, for a call in tail position, pushes the procedure
+// and its arguments, sets tail_call_argc and returns tail_call, like an
+// analyzed body.
+typedef struct NativeLambda {
+    char *name; // NULL if anonymous
+    Object* (*function)(Object *self, int argc);
+    int arity; // as from params_arity
+} NativeLambda;
+
+Object *new_native(const NativeLambda *lambda);
+Object *call_native(int argc);
+Object *call_global(Object *binding, int argc, Object *a, Object *b);
+Object *native_rest(size_t from, int count);
+Object *read_constant(const char *text, size_t length);
+int scheme_main(int argc, char *argv[], int (*module)(void));
+
+extern size_t error_count;
+extern char profiling;
+void profile_finish(void);
+
+// Calls to these globals are compiled inline, by the VM for the first five
+// with an opcode each and by --compile for all of them with the native_
+// helper named here. Either way the inline code only runs while the global
+// still holds the builtin.
+typedef enum InlineIndex {
+    INLINE_ADD, INLINE_SUB, INLINE_LT, INLINE_GT, INLINE_NUM_EQ,
+    INLINE_CAR, INLINE_CDR, INLINE_CONS, INLINE_EQ, INLINE_NULL, INLINE_PAIR,
+    NUM_INLINE_PRIMITIVES
+} InlineIndex;
+
+typedef struct InlinePrimitive {
+    char *name;
+    int argc;
+    char *helper;
+    Object *builtin;
+} InlinePrimitive;
+
+extern InlinePrimitive inline_primitives[NUM_INLINE_PRIMITIVES];
+
+static inline char holds_builtin(Object *binding, InlineIndex index)
+{
+    return binding->value.pair.cdr == inline_primitives[index].builtin;
+}
+
+// The helpers take the global's binding and the evaluated operands. When
+// the operands do not suit the inline code, or the global was redefined,
+// they make an ordinary call, which also reports any error.
+static inline Object *native_add(Object *binding, Object *a, Object *b)
+{
+    Object *result;
+    if (is_fixnum(a) && is_fixnum(b) && holds_builtin(binding, INLINE_ADD)
+            && fixnum_add(a, b, &result))
+        return result;
+    return call_global(binding, 2, a, b);
+}
+
+static inline Object *native_sub(Object *binding, Object *a, Object *b)
+{
+    Object *result;
+    if (is_fixnum(a) && is_fixnum(b) && holds_builtin(binding, INLINE_SUB)
+            && fixnum_sub(a, b, &result))
+        return result;
+    return call_global(binding, 2, a, b);
+}
+
+// Tagged fixnums compare like the integers they encode.
+static inline Object *native_lt(Object *binding, Object *a, Object *b)
+{
+    if (is_fixnum(a) && is_fixnum(b) && holds_builtin(binding, INLINE_LT))
+        return new_boolean((intptr_t)a < (intptr_t)b);
+    return call_global(binding, 2, a, b);
+}
+
+static inline Object *native_gt(Object *binding, Object *a, Object *b)
+{
+    if (is_fixnum(a) && is_fixnum(b) && holds_builtin(binding, INLINE_GT))
+        return new_boolean((intptr_t)a > (intptr_t)b);
+    return call_global(binding, 2, a, b);
+}
+
+static inline Object *native_num_eq(Object *binding, Object *a, Object *b)
+{
+    if (is_fixnum(a) && is_fixnum(b) && holds_builtin(binding, INLINE_NUM_EQ))
+        return new_boolean(a == b);
+    return call_global(binding, 2, a, b);
+}
+
+static inline Object *native_car(Object *binding, Object *pair)
+{
+    if (has_type(pair, PAIR) && holds_builtin(binding, INLINE_CAR))
+        return pair->value.pair.car;
+    return call_global(binding, 1, pair, NULL);
+}
+
+static inline Object *native_cdr(Object *binding, Object *pair)
+{
+    if (has_type(pair, PAIR) && holds_builtin(binding, INLINE_CDR))
+        return pair->value.pair.cdr;
+    return call_global(binding, 1, pair, NULL);
+}
+
+static inline Object *native_cons(Object *binding, Object *a, Object *b)
+{
+    if (holds_builtin(binding, INLINE_CONS))
+        return cons(a, b);
+    return call_global(binding, 2, a, b);
+}
+
+static inline Object *native_eq(Object *binding, Object *a, Object *b)
+{
+    if (holds_builtin(binding, INLINE_EQ))
+        return new_boolean(a == b);
+    return call_global(binding, 2, a, b);
+}
+
+static inline Object *native_null(Object *binding, Object *obj)
+{
+    if (holds_builtin(binding, INLINE_NULL))
+        return new_boolean(obj == nill);
+    return call_global(binding, 1, obj, NULL);
+}
+
+static inline Object *native_pair(Object *binding, Object *obj)
+{
+    if (holds_builtin(binding, INLINE_PAIR))
+        return new_boolean(has_type(obj, PAIR));
+    return call_global(binding, 1, obj, NULL);
+}
+
+// The slots of the frame depth links up env's parent chain.
+static inline Object **native_slots(Object *env, int depth)
+{
+    while (depth-- > 0)
+        env = env->value.frame.parent;
+    return frame_slots(env);
+}
+
+// A variable defined in a body, reported if its definition has not run yet.
+static inline Object *native_defined(Object *value, const char *name)
+{
+    if (value == unassigned) {
+        report_error("%s not defined.", name);
+        return nill;
+    }
+    return value;
+}
+
+#endif